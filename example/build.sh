@@ -2,5 +2,9 @@ mkdir -p build
 cd build
 git clone --depth=1 https://github.com/nlohmann/json.git
 g++ -std=c++11 -I./json/single_include -I../../include -o example ../example.cpp
+g++ -std=c++11 -O2 -I./json/single_include -I../../include -o zero_alloc ../zero_alloc.cpp
+g++ -std=c++11 -I./json/single_include -I../../include -o stream_error ../stream_error.cpp
 cd -
 ./build/example
+./build/zero_alloc
+./build/stream_error
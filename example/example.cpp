@@ -51,6 +51,15 @@ msg_b64 = base64.b64encode(msg.encode()).decode()
         ph::exec("print(f'Python -> C++: {1.0 / (time.time() - t0)} MB/s')");
     }
 
+    {
+        ph::exec("def squares(n):\n    for i in range(n):\n        yield i * i\n");
+        long long total = 0;
+        for (auto v : ph::stream<long long>("squares", 100000)) {
+            total += v;
+        }
+        std::cout << "Sum of streamed squares = " << total << std::endl;
+    }
+
     {
         ph::exec_file("funcs.py");
         ph::call("lets_233", "abcde");
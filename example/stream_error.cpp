@@ -0,0 +1,40 @@
+#include "pyhandler/pyhandler.hpp"
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+
+namespace ph = pyhandler;
+
+
+int main() {
+    auto handler = ph::get_handler();
+    handler->set_vars({"base"}, 40);
+    handler->exec<void>("def gen():\n    yield 1\n    yield 2\n    raise ValueError('broken generator')\n", "None");
+
+    int failures = 0;
+    auto check = [&](const char* name, bool ok) {
+        std::cout << name << ": " << (ok ? "ok" : "failed") << std::endl;
+        failures += !ok;
+    };
+
+    bool thrown = false;
+    try {
+        for (auto v : handler->stream<long long>("gen")) {
+            (void)v;
+        }
+    } catch (const std::exception&) {
+        thrown = true;
+    }
+    check("stream throws", thrown);
+
+    try {
+        check("call after stream", handler->call<int>("lambda x: base + x", 2) == 42);
+    } catch (const std::exception& e) {
+        std::cout << e.what() << std::endl;
+        check("call after stream", false);
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+#include "pyhandler/pyhandler.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+
+namespace ph = pyhandler;
+
+
+static std::atomic<size_t> allocations(0);
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocations++;
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+// Allocations made by n calls of f once the buffers have grown.
+template <class F>
+size_t count_allocations(int n, const F& f) {
+    for (int i = 0; i < 10; ++i) {
+        f();
+    }
+    size_t before = allocations;
+    for (int i = 0; i < n; ++i) {
+        f();
+    }
+    return allocations - before;
+}
+
+
+int main() {
+    auto handler = ph::get_handler();
+    handler->exec<void>("def add(a, b):\n    return a + b\ndef nothing(*args):\n    pass\n", "None");
+
+    std::string s = "a \"quoted\" string\n";
+    std::vector<uint8_t> data(64, 1);
+    ph::NDArray array(data.data(), {data.size()});
+
+    int failures = 0;
+    auto check = [&](const char* name, size_t count) {
+        std::cout << name << ": " << count << " allocations" << std::endl;
+        failures += count != 0;
+    };
+
+    check("call<int>", count_allocations(1000, [&]() { handler->call<int>("add", 1, 2); }));
+    check("call<double>", count_allocations(1000, [&]() { handler->call<double>("add", 1.5, 2.25); }));
+    check("call<void>", count_allocations(1000, [&]() { handler->call<void>("nothing", s, "literal", array); }));
+
+    return failures ? 1 : 0;
+}
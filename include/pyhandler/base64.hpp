@@ -15,10 +15,10 @@ static inline bool is_base64(uint8_t c) {
     return (std::isalnum(c) || (c == '+') || (c == '/'));
 }
 
-inline std::string base64_encode(const std::vector<uint8_t>& data) {
+// Appends the encoding of data to ret.
+inline void base64_encode(const std::vector<uint8_t>& data, std::string& ret) {
     size_t n = data.size();
 
-    std::string ret;
     int i = 0;
     int j = 0;
     int k = 0;
@@ -57,18 +57,22 @@ inline std::string base64_encode(const std::vector<uint8_t>& data) {
             ret += '=';
         }
     }
+}
 
+inline std::string base64_encode(const std::vector<uint8_t>& data) {
+    std::string ret;
+    base64_encode(data, ret);
     return ret;
 }
 
-inline std::vector<uint8_t> base64_decode(const std::string& encoded) {
-    size_t in_len = encoded.size();
+// Appends the decoding of the size bytes at encoded to ret.
+inline void base64_decode(const char* encoded, size_t size, std::vector<uint8_t>& ret) {
+    size_t in_len = size;
     int i = 0;
     int j = 0;
     int k = 0;
     uint8_t c3[3];
     uint8_t c4[4];
-    std::vector<uint8_t> ret;
 
     while (in_len-- && (encoded[k] != '=') && is_base64(encoded[k])) {
         c4[i++] = encoded[k];
@@ -101,7 +105,15 @@ inline std::vector<uint8_t> base64_decode(const std::string& encoded) {
             ret.push_back(c3[j]);
         }
     }
+}
+
+inline void base64_decode(const std::string& encoded, std::vector<uint8_t>& ret) {
+    base64_decode(encoded.data(), encoded.size(), ret);
+}
 
+inline std::vector<uint8_t> base64_decode(const std::string& encoded) {
+    std::vector<uint8_t> ret;
+    base64_decode(encoded, ret);
     return ret;
 }
 
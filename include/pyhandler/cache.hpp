@@ -0,0 +1,127 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "nlohmann/json.hpp"
+
+namespace pyhandler {
+
+using json = nlohmann::json;
+
+struct CachePolicy {
+    size_t max_bytes = 64 << 20;
+    // Zero keeps entries until they are evicted or invalidated.
+    std::chrono::milliseconds ttl{0};
+    bool invalidate_on_exec_file = true;
+    bool invalidate_on_set_vars = true;
+};
+
+struct CacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+// LRU cache of results keyed by the encoded command, bounded by the encoded size of keys and results.
+class ResultCache {
+public:
+    bool get(const std::string& key, json& result) {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = index.find(std::hash<std::string>()(key));
+        if (it == index.end() || it->second->key != key) {
+            stats.misses++;
+            return false;
+        }
+        if (it->second->expires < std::chrono::steady_clock::now()) {
+            erase(it->second);
+            stats.misses++;
+            return false;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        result = it->second->result;
+        stats.hits++;
+        return true;
+    }
+
+    // Bumped by clear(), a result computed before an invalidation is not inserted after it.
+    size_t get_epoch() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return epoch;
+    }
+
+    void put(const std::string& key, const json& result) { put(key, result, get_epoch()); }
+
+    // Inserts only if the cache was not cleared since epoch was read.
+    void put(const std::string& key, const json& result, size_t since_epoch) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (since_epoch != epoch) {
+            return;
+        }
+        size_t hash = std::hash<std::string>()(key);
+        auto it = index.find(hash);
+        if (it != index.end()) {
+            erase(it->second);
+        }
+        size_t bytes = key.size() + result.dump().size();
+        if (bytes > policy.max_bytes) {
+            return;
+        }
+        auto expires = policy.ttl.count() > 0 ? std::chrono::steady_clock::now() + policy.ttl
+                                              : std::chrono::steady_clock::time_point::max();
+        entries.push_front({key, hash, result, bytes, expires});
+        index[hash] = entries.begin();
+        stats.bytes += bytes;
+        stats.entries++;
+        while (stats.bytes > policy.max_bytes) {
+            erase(std::prev(entries.end()));
+            stats.evictions++;
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(mutex);
+        entries.clear();
+        index.clear();
+        epoch++;
+        stats.entries = 0;
+        stats.bytes = 0;
+    }
+
+    CacheStats get_stats() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return stats;
+    }
+
+    CachePolicy policy;
+
+private:
+    struct Entry {
+        std::string key;
+        size_t hash;
+        json result;
+        size_t bytes;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    void erase(std::list<Entry>::iterator entry) {
+        stats.bytes -= entry->bytes;
+        stats.entries--;
+        index.erase(entry->hash);
+        entries.erase(entry);
+    }
+
+    std::mutex mutex;
+    std::list<Entry> entries;
+    std::unordered_map<size_t, std::list<Entry>::iterator> index;
+    CacheStats stats;
+    size_t epoch = 0;
+};
+
+}  // namespace pyhandler
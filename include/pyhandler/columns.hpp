@@ -0,0 +1,200 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+#include "pyhandler/base64.hpp"
+
+namespace pyhandler {
+
+using json = nlohmann::json;
+
+template <class T>
+struct DType {
+    static std::string name() {
+        static_assert(std::is_arithmetic<T>::value, "Column fields must be arithmetic");
+        if (std::is_same<T, bool>::value) {
+            return "bool";
+        }
+        std::string kind = std::is_floating_point<T>::value ? "float" : (std::is_signed<T>::value ? "int" : "uint");
+        return kind + std::to_string(sizeof(T) * 8);
+    }
+};
+
+template <class Record, class Field>
+struct Column {
+    using field_type = Field;
+
+    const char* name;
+    Field Record::*member;
+};
+
+template <class Record, class Field>
+Column<Record, Field> make_column(const char* name, Field Record::*member) {
+    return {name, member};
+}
+
+template <class Record>
+struct ColumnTraits {
+    static constexpr bool defined = false;
+};
+
+#define PYHANDLER_COLUMN(Record, field) ::pyhandler::make_column(#field, &Record::field)
+
+#define PYHANDLER_COLUMN_NARG(...) PYHANDLER_COLUMN_NARG_(__VA_ARGS__, 16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1)
+#define PYHANDLER_COLUMN_NARG_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define PYHANDLER_COLUMN_CONCAT(a, b) PYHANDLER_COLUMN_CONCAT_(a, b)
+#define PYHANDLER_COLUMN_CONCAT_(a, b) a##b
+
+#define PYHANDLER_COLUMN_LIST_1(Record, field) PYHANDLER_COLUMN(Record, field)
+#define PYHANDLER_COLUMN_LIST_2(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_1(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_3(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_2(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_4(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_3(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_5(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_4(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_6(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_5(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_7(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_6(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_8(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_7(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_9(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_8(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_10(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_9(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_11(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_10(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_12(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_11(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_13(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_12(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_14(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_13(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_15(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_14(Record, __VA_ARGS__)
+#define PYHANDLER_COLUMN_LIST_16(Record, field, ...) \
+    PYHANDLER_COLUMN(Record, field), PYHANDLER_COLUMN_LIST_15(Record, __VA_ARGS__)
+
+#define PYHANDLER_COLUMN_LIST(Record, ...) \
+    PYHANDLER_COLUMN_CONCAT(PYHANDLER_COLUMN_LIST_, PYHANDLER_COLUMN_NARG(__VA_ARGS__))(Record, __VA_ARGS__)
+
+// Declares the fields of a record type so that std::vector<Record> is transferred as one buffer per column.
+// Must be used in the global namespace, supports up to 16 arithmetic fields.
+#define PYHANDLER_COLUMNS(Record, ...)                                                                   \
+    namespace pyhandler {                                                                                \
+    template <>                                                                                          \
+    struct ColumnTraits<Record> {                                                                        \
+        static constexpr bool defined = true;                                                            \
+        static auto columns() -> decltype(std::make_tuple(PYHANDLER_COLUMN_LIST(Record, __VA_ARGS__))) { \
+            return std::make_tuple(PYHANDLER_COLUMN_LIST(Record, __VA_ARGS__));                          \
+        }                                                                                                \
+    };                                                                                                   \
+    }
+
+template <class Src, class Record, class Field>
+bool scatter_column(
+        const std::string& dtype, const std::vector<uint8_t>& data, std::vector<Record>& rows,
+        Field Record::*member) {
+    if (dtype != DType<Src>::name()) {
+        return false;
+    }
+    if (data.size() != rows.size() * sizeof(Src)) {
+        throw std::runtime_error("Inconsistent between column and record size");
+    }
+    const Src* src = (const Src*)data.data();
+    for (size_t i = 0; i < rows.size(); ++i) {
+        rows[i].*member = (Field)src[i];
+    }
+    return true;
+}
+
+template <size_t I, size_t N>
+struct ColumnEncoder {
+    template <class Record, class... C>
+    static void impl(const std::vector<Record>& rows, const std::tuple<C...>& columns, json& j) {
+        using Field = typename std::tuple_element<I, std::tuple<C...>>::type::field_type;
+        const auto& column = std::get<I>(columns);
+        std::vector<uint8_t> data(rows.size() * sizeof(Field));
+        Field* dst = (Field*)data.data();
+        for (size_t i = 0; i < rows.size(); ++i) {
+            dst[i] = rows[i].*column.member;
+        }
+        j["names"].push_back(column.name);
+        j["dtypes"].push_back(DType<Field>::name());
+        j["data"].push_back(base64_encode(data));
+        ColumnEncoder<I + 1, N>::impl(rows, columns, j);
+    }
+};
+
+template <size_t N>
+struct ColumnEncoder<N, N> {
+    template <class Record, class... C>
+    static void impl(const std::vector<Record>& rows, const std::tuple<C...>& columns, json& j) {}
+};
+
+template <size_t I, size_t N>
+struct ColumnDecoder {
+    template <class Record, class... C>
+    static void impl(const json& j, const std::tuple<C...>& columns, std::vector<Record>& rows) {
+        const auto& column = std::get<I>(columns);
+        const json& names = j["names"];
+        size_t k = 0;
+        while (k < names.size() && names[k] != column.name) {
+            k++;
+        }
+        if (k == names.size()) {
+            throw std::runtime_error(std::string("Missing column: ") + column.name);
+        }
+        std::string dtype = j["dtypes"][k];
+        std::vector<uint8_t> data = base64_decode(j["data"][k]);
+        bool matched = scatter_column<bool>(dtype, data, rows, column.member) ||
+                       scatter_column<int8_t>(dtype, data, rows, column.member) ||
+                       scatter_column<int16_t>(dtype, data, rows, column.member) ||
+                       scatter_column<int32_t>(dtype, data, rows, column.member) ||
+                       scatter_column<int64_t>(dtype, data, rows, column.member) ||
+                       scatter_column<uint8_t>(dtype, data, rows, column.member) ||
+                       scatter_column<uint16_t>(dtype, data, rows, column.member) ||
+                       scatter_column<uint32_t>(dtype, data, rows, column.member) ||
+                       scatter_column<uint64_t>(dtype, data, rows, column.member) ||
+                       scatter_column<float>(dtype, data, rows, column.member) ||
+                       scatter_column<double>(dtype, data, rows, column.member);
+        if (!matched) {
+            throw std::runtime_error("Unknown column dtype: " + dtype);
+        }
+        ColumnDecoder<I + 1, N>::impl(j, columns, rows);
+    }
+};
+
+template <size_t N>
+struct ColumnDecoder<N, N> {
+    template <class Record, class... C>
+    static void impl(const json& j, const std::tuple<C...>& columns, std::vector<Record>& rows) {}
+};
+
+template <class Record>
+json encode_columns(const std::vector<Record>& rows) {
+    auto columns = ColumnTraits<Record>::columns();
+    json j = json::object(
+            {{"class", "columns"}, {"length", rows.size()}, {"names", json::array()}, {"dtypes", json::array()},
+             {"data", json::array()}});
+    ColumnEncoder<0, std::tuple_size<decltype(columns)>::value>::impl(rows, columns, j);
+    return j;
+}
+
+template <class Record>
+std::vector<Record> decode_columns(const json& j) {
+    auto columns = ColumnTraits<Record>::columns();
+    std::vector<Record> rows((size_t)j["length"]);
+    ColumnDecoder<0, std::tuple_size<decltype(columns)>::value>::impl(j, columns, rows);
+    return rows;
+}
+
+}  // namespace pyhandler
@@ -1,14 +1,29 @@
 #pragma once
 
 #include "nlohmann/json.hpp"
+#include "placement.hpp"
+#include "pool.hpp"
 
 #include <fcntl.h>
 #include <poll.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
 #include <mutex>
 #include <queue>
 #include <thread>
@@ -16,16 +31,31 @@
 namespace pyhandler {
 
 using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+inline int poll_timeout(Clock::time_point deadline) {
+    if (deadline == Clock::time_point::max()) {
+        return 100;
+    }
+    auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count() + 1;
+    return (int)std::max<long long>(0, std::min<long long>(100, remain));
+}
 
 class ReadBuffer {
 public:
     ReadBuffer() {
         str_buf = "";
+        start = 0;
         pos = 0;
     }
 
     ssize_t read_from_fd(int fd) {
         ssize_t tot_bytes = 0;
+        if (start > 0) {
+            str_buf.erase(0, start);
+            pos -= start;
+            start = 0;
+        }
         while (true) {
             ssize_t bytes = read(fd, read_buf.data(), read_buf.size());
             if (bytes == -1) {
@@ -63,25 +93,40 @@ public:
     }
 
     std::string read_line() {
+        std::string line;
+        read_line(line);
+        return line;
+    }
+
+    // Assigns the next line to line, reusing its capacity. Consumed lines are dropped lazily, without copying the
+    // rest of the buffer.
+    bool read_line(std::string& line) {
         if (!has_line()) {
-            return "";
+            line.clear();
+            return false;
         }
-        std::string line = str_buf.substr(0, pos);
-        str_buf = str_buf.substr(pos + 1);
-        pos = 0;
-        return line;
+        line.assign(str_buf, start, pos - start);
+        start = ++pos;
+        if (start == str_buf.size()) {
+            str_buf.clear();
+            start = 0;
+            pos = 0;
+        }
+        return true;
     }
 
     std::array<char, 16384> read_buf;
     std::string str_buf;
+    size_t start;
     size_t pos;
 };
 
+// Writes msg followed by a newline. msg is not copied, it has to outlive the buffer.
 class WriteBuffer {
 public:
     WriteBuffer(int fd, const std::string& msg) {
         this->fd = fd;
-        this->str_buf = msg + "\n";
+        this->msg = &msg;
         this->pos = 0;
     }
 
@@ -89,8 +134,13 @@ public:
 
     ssize_t write_to_fd() {
         ssize_t tot_bytes = 0;
-        while (true) {
-            ssize_t bytes = write(fd, str_buf.data() + pos, str_buf.length() - pos);
+        while (remain()) {
+            size_t size = msg->size();
+            struct iovec iov[2] = {
+                    {(void*)(msg->data() + std::min<size_t>(pos, size)), size - std::min<size_t>(pos, size)},
+                    {(void*)"\n", 1}};
+            int first = (size_t)pos < size ? 0 : 1;
+            ssize_t bytes = writev(fd, iov + first, 2 - first);
             if (bytes == -1) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
                     break;
@@ -117,16 +167,252 @@ public:
         }
     }
 
-    int remain() { return str_buf.size() - pos; }
+    int remain() { return msg->size() + 1 - pos; }
 
     int fd;
-    std::string str_buf;
+    const std::string* msg;
     ssize_t pos;
 };
 
+// Children set PR_SET_PDEATHSIG, which fires when the thread that forked them exits rather than the process. Forks of
+// long-lived children are therefore run on this thread, which lives as long as the process.
+class ForkThread {
+public:
+    static ForkThread& instance() {
+        static ForkThread* thread = new ForkThread();
+        return *thread;
+    }
+
+    // Runs func on the fork thread and waits for it, exceptions are rethrown to the caller.
+    void run(const std::function<void()>& func) {
+        std::lock_guard<std::mutex> run_guard(run_mutex);
+        std::unique_lock<std::mutex> lock(mutex);
+        task = &func;
+        error = nullptr;
+        cond.notify_all();
+        cond.wait(lock, [this]() { return task == nullptr; });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    ForkThread() : task(nullptr) { std::thread(&ForkThread::loop, this).detach(); }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cond.wait(lock, [this]() { return task != nullptr; });
+            try {
+                (*task)();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            task = nullptr;
+            cond.notify_all();
+        }
+    }
+
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable cond;
+    const std::function<void()>* task;
+    std::exception_ptr error;
+};
+
+// Helper process forked while the parent is still small. It forks TaskExecutor workers on request, so spawning them
+// does not copy the page tables of a large parent. Workers can only run code that was mapped when the helper started.
+// The helper is forked from ForkThread and restarted if it exits.
+class ForkServer {
+public:
+    using Entry = int (*)(std::array<int, 2>, uintptr_t);
+
+    static ForkServer& instance() {
+        static ForkServer server;
+        return server;
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> guard(mutex);
+        ensure_running();
+    }
+
+    pid_t spawn(Entry entry, uintptr_t arg, const std::array<int, 2>& io_pipe, const CpuSlot& slot = CpuSlot()) {
+        std::lock_guard<std::mutex> guard(mutex);
+        ensure_running();
+        pid_t pid = request_fork(entry, arg, io_pipe, slot);
+        if (pid == -1 && !is_running()) {
+            ensure_running();
+            pid = request_fork(entry, arg, io_pipe, slot);
+        }
+        if (pid == -1) {
+            throw std::runtime_error("fork server failed");
+        }
+        return pid;
+    }
+
+private:
+    struct Request {
+        Entry entry;
+        uintptr_t arg;
+        cpu_set_t cpus;
+        int node;
+    };
+
+    ForkServer() : control(-1), pid(-1) {}
+
+    ~ForkServer() { stop(); }
+
+    bool is_running() {
+        if (pid != -1 && waitpid(pid, NULL, WNOHANG) != 0) {
+            stop();
+        }
+        return pid != -1;
+    }
+
+    void ensure_running() {
+        if (is_running()) {
+            return;
+        }
+        std::array<int, 2> sv;
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv.data()) == -1) {
+            throw std::runtime_error("create fork server socket failed");
+        }
+        pid_t p = -1;
+        ForkThread::instance().run([&]() {
+            p = fork();
+            if (p == 0) {
+                close(sv[0]);
+                prctl(PR_SET_PDEATHSIG, SIGHUP);
+                serve(sv[1]);
+                _exit(0);
+            }
+        });
+        close(sv[1]);
+        if (p == -1) {
+            close(sv[0]);
+            throw std::runtime_error("fork server failed");
+        }
+        control = sv[0];
+        pid = p;
+    }
+
+    void stop() {
+        if (control != -1) {
+            close(control);
+            control = -1;
+        }
+        if (pid != -1) {
+            waitpid(pid, NULL, 0);
+            pid = -1;
+        }
+    }
+
+    // Returns -1 when the helper does not answer.
+    pid_t request_fork(Entry entry, uintptr_t arg, const std::array<int, 2>& io_pipe, const CpuSlot& slot) {
+        Request request = {entry, arg, to_cpu_mask(slot.cpus), slot.node};
+        char control_buf[CMSG_SPACE(sizeof(int) * 2)] = {};
+        struct iovec iov = {&request, sizeof(request)};
+        struct msghdr hdr = {};
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control_buf;
+        hdr.msg_controllen = sizeof(control_buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+        memcpy(CMSG_DATA(cmsg), io_pipe.data(), sizeof(int) * 2);
+
+        pid_t child = -1;
+        if (sendmsg(control, &hdr, MSG_NOSIGNAL) == -1 || recv(control, &child, sizeof(child), 0) != sizeof(child)) {
+            return -1;
+        }
+        return child;
+    }
+
+    static void serve(int control) {
+        signal(SIGCHLD, SIG_IGN);
+        while (true) {
+            Request request;
+            char control_buf[CMSG_SPACE(sizeof(int) * 2)];
+            struct iovec iov = {&request, sizeof(request)};
+            struct msghdr hdr = {};
+            hdr.msg_iov = &iov;
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = control_buf;
+            hdr.msg_controllen = sizeof(control_buf);
+            if (recvmsg(control, &hdr, 0) != sizeof(request) || !CMSG_FIRSTHDR(&hdr)) {
+                return;
+            }
+            std::array<int, 2> io_pipe;
+            memcpy(io_pipe.data(), CMSG_DATA(CMSG_FIRSTHDR(&hdr)), sizeof(int) * 2);
+
+            pid_t p = fork();
+            if (p == 0) {
+                close(control);
+                signal(SIGCHLD, SIG_DFL);
+                prctl(PR_SET_PDEATHSIG, SIGHUP);
+                apply_placement(request.cpus, request.node);
+                int ret = request.entry(io_pipe, request.arg);
+                fflush(NULL);
+                _exit(ret);
+            }
+            close(io_pipe[0]);
+            close(io_pipe[1]);
+            send(control, &p, sizeof(p), MSG_NOSIGNAL);
+        }
+    }
+
+    int control;
+    pid_t pid;
+    std::mutex mutex;
+};
+
+// Starts the fork server, call it early in main while the heap is still small and before other threads exist.
+inline void start_fork_server() {
+    ForkServer::instance().start();
+}
+
+// Resident set size of the process in bytes, 0 when it can not be read.
+inline size_t read_rss(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    char buf[128];
+    ssize_t bytes = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (bytes <= 0) {
+        return 0;
+    }
+    buf[bytes] = 0;
+    unsigned long size, resident;
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+        return 0;
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Limits after which an interpreter or worker process is replaced by a fresh one. Zero means no limit.
+struct RecyclePolicy {
+    size_t max_rss = 0;
+    size_t max_calls = 0;
+    std::chrono::milliseconds max_age{0};
+
+    bool due(size_t calls, Clock::duration age, size_t rss) const {
+        return (max_calls && calls >= max_calls) || (max_age.count() && age >= max_age) || (max_rss && rss >= max_rss);
+    }
+};
+
 class Process {
 public:
     Process() {
+        pid = -1;
+        proc_is_alive = false;
+        adopted = false;
         if (pipe(to_child.data()) == -1 || pipe(to_parent.data()) == -1) {
             throw std::runtime_error("create pipe failed");
         }
@@ -142,21 +428,52 @@ public:
         close(to_parent[1]);
     }
 
+    // Binds the child to the CPUs of the slot when it starts.
+    void place(const CpuSlot& cpu_slot) { slot = cpu_slot; }
+
+    WorkerPlacement placement() const {
+        if (slot.cpus.empty()) {
+            return get_placement(pid);
+        }
+        WorkerPlacement placement;
+        placement.pid = pid;
+        placement.cpus = slot.cpus;
+        placement.node = slot.node;
+        return placement;
+    }
+
+    // The ends of the pipes the child reads from and writes to, known before it starts.
+    std::array<int, 2> child_io_pipe() const { return {{to_child[0], to_parent[1]}}; }
+
     template <class F, class... Args>
     void start(const F& func, const Args&... args) {
-        std::array<int, 2> child_io_pipe = {to_child[0], to_parent[1]};
+        std::array<int, 2> child_io_pipe = this->child_io_pipe();
 
         pid_t p = fork();
         if (p > 0) {
             pid = p;
             proc_is_alive = true;
+            started = Clock::now();
         } else {
             prctl(PR_SET_PDEATHSIG, SIGHUP);
+            apply_placement(slot);
             exit(func(child_io_pipe, args...));
         }
     }
 
-    void set_fd_nonblock(int fd) {
+    // Starts the child through the fork server, it is not a child of this process and is reaped by the server.
+    void spawn(ForkServer& server, ForkServer::Entry entry, uintptr_t arg) {
+        pid = server.spawn(entry, arg, child_io_pipe(), slot);
+        proc_is_alive = true;
+        adopted = true;
+        started = Clock::now();
+    }
+
+    size_t rss() const { return read_rss(pid); }
+
+    Clock::duration age() const { return Clock::now() - started; }
+
+    static void set_fd_nonblock(int fd) {
         int flags = fcntl(fd, F_GETFL, 0);
         if (flags == -1) {
             throw std::runtime_error("fcntl failed");
@@ -167,10 +484,16 @@ public:
         }
     }
 
+    // Safe to call from the writing and the reading thread at once, the child is reaped by whichever sees it exit.
     bool is_alive() {
+        std::lock_guard<std::mutex> guard(alive_mutex);
         if (!proc_is_alive) {
             return false;
         }
+        if (adopted) {
+            proc_is_alive = ::kill(pid, 0) == 0;
+            return proc_is_alive;
+        }
         int status;
         int ret = waitpid(pid, &status, WNOHANG);
         if (ret == -1) {
@@ -194,12 +517,26 @@ public:
         }
     }
 
-    bool write_to_proc(const std::string& msg) {
+    void kill(int sig) {
+        if (is_alive()) {
+            ::kill(pid, sig);
+        }
+    }
+
+    // Returns false when the deadline passes first, written tells whether part of msg got out by then.
+    bool write_to_proc(
+            const std::string& msg, Clock::time_point deadline = Clock::time_point::max(), bool* written = nullptr) {
         if (is_alive()) {
             WriteBuffer buf(to_child[1], msg);
             while (is_alive() && buf.remain()) {
+                if (Clock::now() >= deadline) {
+                    if (written) {
+                        *written = buf.pos > 0;
+                    }
+                    return false;
+                }
                 struct pollfd pfd = {to_child[1], POLLOUT};
-                if (poll(&pfd, 1, 100) > 0) {
+                if (poll(&pfd, 1, poll_timeout(deadline)) > 0) {
                     while (buf.write_to_fd())
                         ;
                 }
@@ -208,16 +545,20 @@ public:
         return is_alive();
     }
 
-    bool read_from_proc(std::string& msg) {
+    bool read_from_proc(std::string& msg, Clock::time_point deadline = Clock::time_point::max()) {
+        if (rbuf.read_line(msg)) {
+            return true;
+        }
         if (is_alive()) {
-            ReadBuffer buf = {};
             while (is_alive()) {
+                if (Clock::now() >= deadline) {
+                    return false;
+                }
                 struct pollfd pfd = {to_parent[0], POLLIN};
-                if (poll(&pfd, 1, 100) > 0) {
-                    while (buf.read_from_fd(to_parent[0]))
+                if (poll(&pfd, 1, poll_timeout(deadline)) > 0) {
+                    while (rbuf.read_from_fd(to_parent[0]))
                         ;
-                    if (buf.has_line()) {
-                        msg = buf.read_line();
+                    if (rbuf.read_line(msg)) {
                         return true;
                     }
                 }
@@ -241,10 +582,215 @@ private:
     std::array<int, 2> to_child;
     std::array<int, 2> to_parent;
     bool proc_is_alive;
+    std::mutex alive_mutex;
+    bool adopted;
+    ReadBuffer rbuf;
+    CpuSlot slot;
+    Clock::time_point started;
 };
 
+inline int write_memfd(const std::vector<uint8_t>& data) {
+    int fd = memfd_create("pyhandler", MFD_CLOEXEC);
+    if (fd == -1 || ftruncate(fd, data.size()) == -1) {
+        throw std::runtime_error("create memfd failed");
+    }
+    if (!data.empty()) {
+        void* ptr = mmap(NULL, data.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("mmap memfd failed");
+        }
+        memcpy(ptr, data.data(), data.size());
+        munmap(ptr, data.size());
+    }
+    return fd;
+}
+
+inline std::vector<uint8_t> read_memfd(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        throw std::runtime_error("stat memfd failed");
+    }
+    std::vector<uint8_t> data = ArrayPool::instance().acquire(st.st_size);
+    data.resize(st.st_size);
+    if (!data.empty()) {
+        void* ptr = mmap(NULL, data.size(), PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            throw std::runtime_error("mmap memfd failed");
+        }
+        memcpy(data.data(), ptr, data.size());
+        munmap(ptr, data.size());
+    }
+    return data;
+}
+
+// Line-based connection to a shared interpreter, file descriptors travel with the line they belong to.
+class UnixSocket {
+public:
+    static const size_t max_fds = 253;
+
+    explicit UnixSocket(const std::string& path) {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("socket path too long");
+        }
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            throw std::runtime_error("create socket failed");
+        }
+        int flags = -1;
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || (flags = fcntl(fd, F_GETFL, 0)) == -1 ||
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            close(fd);
+            throw std::runtime_error("connect to " + path + " failed");
+        }
+        connected = true;
+    }
+
+    ~UnixSocket() {
+        close(fd);
+        for (int f : fds) {
+            close(f);
+        }
+    }
+
+    bool is_connected() const { return connected; }
+
+    // Wakes a read or write in progress on another thread, they fail as if the server had disconnected.
+    void shutdown() { ::shutdown(fd, SHUT_RDWR); }
+
+    // Returns false when the deadline passes first, written tells whether part of msg got out by then.
+    bool write_to_server(
+            const std::string& msg, const std::vector<int>& out_fds, Clock::time_point deadline,
+            bool* written = nullptr) {
+        if (out_fds.size() > max_fds) {
+            throw std::runtime_error("too many file descriptors in one message");
+        }
+        std::string buf = msg + "\n";
+        size_t pos = 0;
+        std::vector<char> control(out_fds.empty() ? 0 : CMSG_SPACE(sizeof(int) * out_fds.size()));
+        while (connected && pos < buf.size()) {
+            if (Clock::now() >= deadline) {
+                if (written) {
+                    *written = pos > 0;
+                }
+                return false;
+            }
+            struct pollfd pfd = {fd, POLLOUT};
+            if (poll(&pfd, 1, poll_timeout(deadline)) <= 0) {
+                continue;
+            }
+            struct iovec iov = {(void*)(buf.data() + pos), buf.size() - pos};
+            struct msghdr hdr = {};
+            hdr.msg_iov = &iov;
+            hdr.msg_iovlen = 1;
+            if (pos == 0 && !control.empty()) {
+                hdr.msg_control = control.data();
+                hdr.msg_controllen = control.size();
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int) * out_fds.size());
+                memcpy(CMSG_DATA(cmsg), out_fds.data(), sizeof(int) * out_fds.size());
+            }
+            ssize_t bytes = sendmsg(fd, &hdr, MSG_NOSIGNAL);
+            if (bytes == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    connected = false;
+                }
+            } else {
+                pos += bytes;
+            }
+        }
+        return connected;
+    }
+
+    bool read_from_server(std::string& msg, std::vector<int>& in_fds, Clock::time_point deadline) {
+        while (!rbuf.has_line()) {
+            if (!connected || Clock::now() >= deadline) {
+                return false;
+            }
+            struct pollfd pfd = {fd, POLLIN};
+            if (poll(&pfd, 1, poll_timeout(deadline)) > 0) {
+                while (read_from_fd())
+                    ;
+            }
+        }
+        rbuf.read_line(msg);
+        in_fds.insert(in_fds.end(), fds.begin(), fds.end());
+        fds.clear();
+        return true;
+    }
+
+private:
+    ssize_t read_from_fd() {
+        char control[CMSG_SPACE(sizeof(int) * max_fds)];
+        struct iovec iov = {rbuf.read_buf.data(), rbuf.read_buf.size()};
+        struct msghdr hdr = {};
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        ssize_t bytes = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+        if (bytes == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                connected = false;
+            }
+            return 0;
+        } else if (bytes == 0) {
+            connected = false;
+            return 0;
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                int* data = (int*)CMSG_DATA(cmsg);
+                fds.insert(fds.end(), data, data + n);
+            }
+        }
+        rbuf.str_buf.append(rbuf.read_buf.data(), bytes);
+        return bytes;
+    }
+
+    int fd;
+    std::atomic<bool> connected;
+    ReadBuffer rbuf;
+    std::vector<int> fds;
+};
+
+struct TaskOptions {
+    TaskOptions() {}
+
+    TaskOptions(const Placement& placement) : placement(placement) {}
+
+    Placement placement;
+    // Workers over the limits finish their current task and are replaced by a fresh process.
+    RecyclePolicy recycle;
+};
+
+struct WorkerStats {
+    // Placement of the worker's latest process.
+    WorkerPlacement placement;
+    size_t tasks = 0;
+    size_t spawns = 0;
+    size_t recycles = 0;
+};
+
+struct TaskStats {
+    std::vector<WorkerStats> workers;
+};
+
+template <class F, class Args, class Callback>
+TaskStats execute_tasks(
+        size_t num_workers, const F& func, const std::vector<Args>& args, const Callback& callback,
+        const TaskOptions& options = TaskOptions());
+
 template <class F, class Args, class Callback>
-void execute_tasks(size_t num_workers, const F& func, const std::vector<Args>& args, const Callback& callback);
+TaskStats execute_tasks_lean(
+        size_t num_workers, const F& func, const std::vector<Args>& args, const Callback& callback,
+        const TaskOptions& options = TaskOptions());
 
 template <
         class F, class Args, class Callback = std::function<void(size_t, typename std::result_of<F&(Args)>::type)>,
@@ -253,9 +799,13 @@ class TaskExecutor {
 private:
     TaskExecutor() = delete;
 
-    explicit TaskExecutor(size_t num_workers) { this->num_workers = num_workers; }
+    TaskExecutor(size_t num_workers, const TaskOptions& options) : options(options) {
+        this->num_workers = num_workers;
+        stats.workers.resize(num_workers);
+    }
 
     static int execute_on_child(const std::array<int, 2>& io_pipe, const F& func, const std::vector<Args>& args) {
+        Process::set_fd_nonblock(io_pipe[0]);
         while (true) {
             ReadBuffer rbuf = {};
             int idx = std::stoi(rbuf.block_readline(io_pipe[0]));
@@ -268,16 +818,62 @@ private:
 
             auto ret = func(args[idx]);
             json jret = ret;
+            std::string reply = jret.dump();
+
+            WriteBuffer wbuf(io_pipe[1], reply);
+            wbuf.block_write();
+        }
+        return -1;
+    }
+
+    static int execute_lean_on_child(std::array<int, 2> io_pipe, uintptr_t func_addr) {
+        auto func = reinterpret_cast<typename std::decay<F>::type>(func_addr);
+        Process::set_fd_nonblock(io_pipe[0]);
+        ReadBuffer rbuf = {};
+        while (true) {
+            std::string line = rbuf.block_readline(io_pipe[0]);
+            if (line == "EXIT") {
+                return 0;
+            }
+
+            auto ret = func(json::parse(line).get<Args>());
+            json jret = ret;
+            std::string reply = jret.dump();
 
-            WriteBuffer wbuf(io_pipe[1], jret.dump());
+            WriteBuffer wbuf(io_pipe[1], reply);
             wbuf.block_write();
         }
         return -1;
     }
 
+    void start_worker(Process& child, const F& func, const std::vector<Args>& args, std::false_type) {
+        child.start(execute_on_child, func, args);
+    }
+
+    void start_worker(Process& child, const F& func, const std::vector<Args>& args, std::true_type) {
+        typename std::decay<F>::type ptr = func;
+        child.spawn(ForkServer::instance(), execute_lean_on_child, reinterpret_cast<uintptr_t>(ptr));
+    }
+
+    std::string task_message(const std::vector<Args>& args, size_t idx, std::false_type) { return std::to_string(idx); }
+
+    std::string task_message(const std::vector<Args>& args, size_t idx, std::true_type) {
+        return json(args[idx]).dump();
+    }
+
+    std::string exit_message(std::false_type) { return "-1"; }
+
+    std::string exit_message(std::true_type) { return "EXIT"; }
+
+    template <bool Lean>
     void control_worker(
-            const F& func, const std::vector<Args>& args, std::queue<size_t>& input_idxes, const Callback& callback) {
+            size_t worker, const F& func, const std::vector<Args>& args, std::queue<size_t>& input_idxes,
+            const Callback& callback) {
+        std::integral_constant<bool, Lean> lean;
+        WorkerStats& worker_stats = stats.workers[worker];
         std::shared_ptr<Process> child = nullptr;
+        std::vector<std::shared_ptr<Process>> retired;
+        size_t child_tasks = 0;
 
         while (true) {
             int selected_idx = -1;
@@ -289,18 +885,24 @@ private:
                 }
             }
 
-            if (!child || !child->is_alive()) {
-                child = std::make_shared<Process>();
-                child->start(execute_on_child, func, args);
-            }
-
             if (selected_idx == -1) {
-                child->write_to_proc("-1");
-                child->join();
+                if (child) {
+                    child->write_to_proc(exit_message(lean));
+                    child->join();
+                }
                 return;
             }
 
-            bool write_success = child->write_to_proc(std::to_string(selected_idx));
+            if (!child || !child->is_alive()) {
+                child = std::make_shared<Process>();
+                child->place(options.placement.slot(worker));
+                start_worker(*child, func, args, lean);
+                worker_stats.placement = child->placement();
+                worker_stats.spawns++;
+                child_tasks = 0;
+            }
+
+            bool write_success = child->write_to_proc(task_message(args, selected_idx, lean));
 
             bool success = false;
             if (write_success) {
@@ -309,43 +911,79 @@ private:
                 if (read_success) {
                     std::lock_guard<std::mutex> guard(task_mutex);
                     callback(selected_idx, json::parse(msg));
+                    worker_stats.tasks++;
                     success = true;
                 }
             }
             if (!success) {
                 throw std::runtime_error("execute task failed");
             }
+
+            // A retired worker exits on its own, it is only joined once this worker is done.
+            child_tasks++;
+            const RecyclePolicy& recycle = options.recycle;
+            if (recycle.due(child_tasks, child->age(), recycle.max_rss ? child->rss() : 0)) {
+                child->write_to_proc(exit_message(lean));
+                retired.push_back(child);
+                child = nullptr;
+                worker_stats.recycles++;
+            }
         }
     }
 
-    void execute(const F& func, const std::vector<Args>& args, const Callback& callback) {
+    template <bool Lean>
+    TaskStats execute(const F& func, const std::vector<Args>& args, const Callback& callback) {
         std::vector<std::shared_ptr<std::thread>> workers = {};
         std::queue<size_t> input_idxes;
         for (size_t i = 0; i < args.size(); ++i) {
             input_idxes.push(i);
         }
-        auto worker_func = [&]() { control_worker(func, args, input_idxes, callback); };
+        auto worker_func = [&](size_t worker) { control_worker<Lean>(worker, func, args, input_idxes, callback); };
         for (size_t i = 0; i < num_workers; ++i) {
-            workers.push_back(std::make_shared<std::thread>(worker_func));
+            workers.push_back(std::make_shared<std::thread>(worker_func, i));
         }
         for (size_t i = 0; i < num_workers; ++i) {
             workers[i]->join();
         }
+        return stats;
     }
 
-    friend void execute_tasks<F, Args, Callback>(
-            size_t num_workers, const F& func, const std::vector<Args>& args, const Callback& callback);
+    friend TaskStats execute_tasks<F, Args, Callback>(
+            size_t num_workers, const F& func, const std::vector<Args>& args, const Callback& callback,
+            const TaskOptions& options);
+
+    friend TaskStats execute_tasks_lean<F, Args, Callback>(
+            size_t num_workers, const F& func, const std::vector<Args>& args, const Callback& callback,
+            const TaskOptions& options);
 
 private:
     size_t num_workers;
+    TaskOptions options;
+    TaskStats stats;
     std::mutex task_mutex;
     std::mutex callback_mutex;
 };
 
+// Runs func over args in num_workers forked processes, placed and recycled according to options.
+template <class F, class Args, class Callback>
+TaskStats execute_tasks(
+        size_t num_workers, const F& func, const std::vector<Args>& args, const Callback& callback,
+        const TaskOptions& options) {
+    TaskExecutor<F, Args, Callback> f(num_workers, options);
+    return f.template execute<false>(func, args, callback);
+}
+
+// Like execute_tasks, but workers are forked from the fork server and receive their inputs as JSON. func must be a
+// plain function (or function pointer) and Args must be convertible from JSON.
 template <class F, class Args, class Callback>
-void execute_tasks(size_t num_workers, const F& func, const std::vector<Args>& args, const Callback& callback) {
-    TaskExecutor<F, Args, Callback> f(num_workers);
-    f.execute(func, args, callback);
+TaskStats execute_tasks_lean(
+        size_t num_workers, const F& func, const std::vector<Args>& args, const Callback& callback,
+        const TaskOptions& options) {
+    static_assert(
+            std::is_function<typename std::remove_pointer<typename std::decay<F>::type>::type>::value,
+            "execute_tasks_lean requires a plain function");
+    TaskExecutor<F, Args, Callback> f(num_workers, options);
+    return f.template execute<true>(func, args, callback);
 }
 
 }  // namespace pyhandler
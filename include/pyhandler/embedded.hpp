@@ -0,0 +1,226 @@
+#pragma once
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace pyhandler {
+
+class Gil {
+public:
+    Gil() { state = PyGILState_Ensure(); }
+
+    ~Gil() { PyGILState_Release(state); }
+
+    Gil(Gil const&) = delete;
+    void operator=(Gil const&) = delete;
+
+private:
+    PyGILState_STATE state;
+};
+
+// Raises KeyboardInterrupt in the calling thread if it is still running Python code at the deadline.
+class Watchdog {
+public:
+    explicit Watchdog(Clock::time_point deadline) {
+        thread_id = PyThread_get_thread_ident();
+        done = false;
+        if (deadline != Clock::time_point::max()) {
+            thread = std::thread([this, deadline]() { run(deadline); });
+        }
+    }
+
+    // Must be called with the GIL held, right after the watched code returns.
+    void finish() {
+        std::lock_guard<std::mutex> guard(mutex);
+        done = true;
+        cond.notify_all();
+        PyThreadState_SetAsyncExc(thread_id, NULL);
+    }
+
+    ~Watchdog() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+private:
+    void run(Clock::time_point deadline) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (cond.wait_until(lock, deadline, [this]() { return done; })) {
+                return;
+            }
+        }
+        Gil gil;
+        std::lock_guard<std::mutex> guard(mutex);
+        if (!done) {
+            PyThreadState_SetAsyncExc(thread_id, PyExc_KeyboardInterrupt);
+        }
+    }
+
+    unsigned long thread_id;
+    bool done;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+};
+
+inline std::string fetch_python_error() {
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    std::string msg = type ? ((PyTypeObject*)type)->tp_name : "Python error";
+    PyObject* str = value ? PyObject_Str(value) : NULL;
+    if (str) {
+        const char* text = PyUnicode_AsUTF8(str);
+        if (text) {
+            msg = msg + ": " + text;
+        }
+    }
+    PyErr_Clear();
+    Py_XDECREF(str);
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+    return msg;
+}
+
+// Runs the interpreter inside the current process. Every backend owns its own globals, the interpreter itself is
+// shared and initialized once. The GIL is only held while Python code runs.
+class EmbeddedBackend : public Backend {
+public:
+    EmbeddedBackend() {
+        static std::once_flag init_flag;
+        std::call_once(init_flag, []() {
+            if (!Py_IsInitialized()) {
+                Py_InitializeEx(0);
+                PyEval_SaveThread();
+            }
+        });
+        globals = NULL;
+        start();
+    }
+
+    ~EmbeddedBackend() {
+        Gil gil;
+        Py_XDECREF(globals);
+    }
+
+    void start() override {
+        std::string source =
+#include "pyhandler.py"
+                ;
+        Gil gil;
+        Py_XDECREF(globals);
+        globals = PyDict_New();
+        PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+        PyObject* name = PyUnicode_FromString("__pyhandler__");
+        PyDict_SetItemString(globals, "__name__", name);
+        Py_DECREF(name);
+        PyObject* ret = PyRun_String(source.c_str(), Py_file_input, globals, globals);
+        if (!ret) {
+            throw std::runtime_error(fetch_python_error());
+        }
+        Py_DECREF(ret);
+        dispatch = PyDict_GetItemString(globals, "__dispatch");
+        next_reply = PyDict_GetItemString(globals, "__next_reply");
+        wake_reader = PyDict_GetItemString(globals, "__wake_reader");
+        stopped = false;
+    }
+
+    // Runs the command, its replies are queued for read(). Async calls only reply 'pending' here, their result is
+    // queued from the event loop thread.
+    bool write(const std::string& msg, Clock::time_point deadline) override {
+        SharedArrays* arrays = SharedArrays::current();
+        std::unique_ptr<Watchdog> watchdog;
+        Gil gil;
+
+        PyObject* params = PyList_New(0);
+        if (arrays) {
+            for (const NDArray* array : arrays->params) {
+                PyObject* view = PyMemoryView_FromMemory(
+                        (char*)array->data.data(), (Py_ssize_t)array->data.size(), PyBUF_READ);
+                PyList_Append(params, view);
+                Py_DECREF(view);
+            }
+        }
+
+        watchdog.reset(new Watchdog(deadline));
+        PyObject* ret = PyObject_CallFunction(dispatch, "s#O", msg.data(), (Py_ssize_t)msg.size(), params);
+        watchdog->finish();
+        Py_DECREF(params);
+        if (!ret) {
+            throw std::runtime_error(fetch_python_error());
+        }
+
+        for (Py_ssize_t i = 0; arrays && i < PyList_Size(ret); ++i) {
+            Py_buffer view;
+            if (PyObject_GetBuffer(PyList_GetItem(ret, i), &view, PyBUF_C_CONTIGUOUS) != 0) {
+                Py_DECREF(ret);
+                throw std::runtime_error(fetch_python_error());
+            }
+            uint8_t* ptr = (uint8_t*)view.buf;
+            arrays->results.push_back(ArrayPool::instance().acquire(view.len));
+            arrays->results.back().assign(ptr, ptr + view.len);
+            PyBuffer_Release(&view);
+        }
+        Py_DECREF(ret);
+        return true;
+    }
+
+    bool read(std::string& msg, Clock::time_point deadline) override {
+        if (stopped) {
+            return false;
+        }
+        Gil gil;
+        PyObject* timeout = Py_None;
+        if (deadline != Clock::time_point::max()) {
+            timeout = PyFloat_FromDouble(std::max(0.0, std::chrono::duration<double>(deadline - Clock::now()).count()));
+        } else {
+            Py_INCREF(timeout);
+        }
+        PyObject* ret = PyObject_CallFunctionObjArgs(next_reply, timeout, NULL);
+        Py_DECREF(timeout);
+        if (!ret) {
+            throw std::runtime_error(fetch_python_error());
+        }
+        if (ret == Py_None) {
+            Py_DECREF(ret);
+            return false;
+        }
+        Py_ssize_t size;
+        const char* line = PyUnicode_AsUTF8AndSize(ret, &size);
+        msg.assign(line, size);
+        Py_DECREF(ret);
+        return true;
+    }
+
+    // Commands are interrupted by the watchdog inside write(), nothing is left running here.
+    bool interrupt() override { return true; }
+
+    // Wakes a thread waiting in read(), reads fail until the next start().
+    void kill() override {
+        stopped = true;
+        Gil gil;
+        Py_XDECREF(PyObject_CallFunctionObjArgs(wake_reader, NULL));
+    }
+
+    bool shares_arrays() const override { return true; }
+
+private:
+    PyObject* globals;
+    PyObject* dispatch;
+    PyObject* next_reply;
+    PyObject* wake_reader;
+    std::atomic<bool> stopped;
+};
+
+}  // namespace pyhandler
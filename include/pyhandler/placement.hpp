@@ -0,0 +1,219 @@
+#pragma once
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace pyhandler {
+
+// Parses a kernel cpu list such as "0-3,8-11".
+inline std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        size_t dash = range.find('-');
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } catch (const std::exception&) {
+        }
+    }
+    return cpus;
+}
+
+inline std::vector<int> get_affinity(pid_t pid) {
+    std::vector<int> cpus;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(pid, sizeof(mask), &mask) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &mask)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+// CPUs usable by this process grouped by NUMA node. Without /sys/devices/system/node all CPUs form node 0.
+class CpuTopology {
+public:
+    explicit CpuTopology(std::vector<std::vector<int>> nodes) : nodes(std::move(nodes)) {}
+
+    static const CpuTopology& instance() {
+        static CpuTopology topology(read_nodes());
+        return topology;
+    }
+
+    int node_of(int cpu) const {
+        for (size_t node = 0; node < nodes.size(); ++node) {
+            for (int c : nodes[node]) {
+                if (c == cpu) {
+                    return (int)node;
+                }
+            }
+        }
+        return -1;
+    }
+
+    // The node holding all of the given CPUs, -1 when they span nodes.
+    int node_of(const std::vector<int>& cpus) const {
+        int node = cpus.empty() ? -1 : node_of(cpus[0]);
+        for (int cpu : cpus) {
+            if (node_of(cpu) != node) {
+                return -1;
+            }
+        }
+        return node;
+    }
+
+    std::vector<std::vector<int>> nodes;
+
+private:
+    static std::vector<std::vector<int>> read_nodes() {
+        std::vector<int> allowed = get_affinity(0);
+        std::vector<std::vector<int>> nodes;
+        for (int node = 0;; ++node) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!file) {
+                break;
+            }
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus;
+            for (int cpu : parse_cpu_list(list)) {
+                if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+                    cpus.push_back(cpu);
+                }
+            }
+            nodes.push_back(cpus);
+        }
+        if (nodes.empty()) {
+            nodes.push_back(allowed);
+        }
+        return nodes;
+    }
+};
+
+// CPUs a single process is bound to, and the NUMA node its memory should come from (-1 for no preference).
+struct CpuSlot {
+    std::vector<int> cpus;
+    int node = -1;
+};
+
+// Assigns CPUs to worker slots. compact fills node 0 before moving on to the next node, spread deals slots round
+// robin over the nodes, explicit_cpus takes one CPU list per slot. Slots beyond the available CPUs wrap around. The
+// topology is copied, so a temporary one can be passed.
+class Placement {
+public:
+    enum Policy { NONE, COMPACT, SPREAD, EXPLICIT };
+
+    Placement() : policy(NONE) {}
+
+    static Placement compact(const CpuTopology& topology = CpuTopology::instance()) {
+        return Placement(COMPACT, {}, topology);
+    }
+
+    static Placement spread(const CpuTopology& topology = CpuTopology::instance()) {
+        return Placement(SPREAD, {}, topology);
+    }
+
+    static Placement explicit_cpus(
+            std::vector<std::vector<int>> cpus, const CpuTopology& topology = CpuTopology::instance()) {
+        return Placement(EXPLICIT, std::move(cpus), topology);
+    }
+
+    CpuSlot slot(size_t idx) const {
+        CpuSlot slot;
+        if (policy == COMPACT) {
+            std::vector<int> all;
+            for (const auto& cpus : topology->nodes) {
+                all.insert(all.end(), cpus.begin(), cpus.end());
+            }
+            if (!all.empty()) {
+                slot.cpus = {all[idx % all.size()]};
+            }
+        } else if (policy == SPREAD) {
+            std::vector<const std::vector<int>*> nodes;
+            for (const auto& cpus : topology->nodes) {
+                if (!cpus.empty()) {
+                    nodes.push_back(&cpus);
+                }
+            }
+            if (!nodes.empty()) {
+                const std::vector<int>& cpus = *nodes[idx % nodes.size()];
+                slot.cpus = {cpus[(idx / nodes.size()) % cpus.size()]};
+            }
+        } else if (policy == EXPLICIT && !cpus.empty()) {
+            slot.cpus = cpus[idx % cpus.size()];
+        }
+        if (topology) {
+            slot.node = topology->node_of(slot.cpus);
+        }
+        return slot;
+    }
+
+    Policy policy;
+
+private:
+    Placement(Policy policy, std::vector<std::vector<int>> cpus, const CpuTopology& topology)
+            : policy(policy), cpus(std::move(cpus)), topology(std::make_shared<CpuTopology>(topology)) {}
+
+    std::vector<std::vector<int>> cpus;
+    std::shared_ptr<const CpuTopology> topology;
+};
+
+inline cpu_set_t to_cpu_mask(const std::vector<int>& cpus) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &mask);
+        }
+    }
+    return mask;
+}
+
+// Binds the calling process to the CPUs in mask, an empty mask leaves it unbound. Memory is preferably allocated on
+// node, so pages the process touches first, including buffers it shares with the parent, stay local.
+inline void apply_placement(const cpu_set_t& mask, int node) {
+    if (CPU_COUNT(&mask) == 0) {
+        return;
+    }
+    sched_setaffinity(0, sizeof(mask), &mask);
+    if (node >= 0 && node < 64) {
+        unsigned long nodemask = 1UL << node;
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, 64);
+    }
+}
+
+inline void apply_placement(const CpuSlot& slot) {
+    apply_placement(to_cpu_mask(slot.cpus), slot.node);
+}
+
+struct WorkerPlacement {
+    pid_t pid = -1;
+    std::vector<int> cpus;
+    int node = -1;
+};
+
+inline WorkerPlacement get_placement(pid_t pid) {
+    WorkerPlacement placement;
+    placement.pid = pid;
+    placement.cpus = get_affinity(pid);
+    placement.node = CpuTopology::instance().node_of(placement.cpus);
+    return placement;
+}
+
+}  // namespace pyhandler
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace pyhandler {
+
+// Buffers of released arrays, handed out again for the payload of arrays received later. Releasing the data of a
+// result once it is consumed lets repeated calls returning arrays of similar size reuse memory instead of allocating.
+class ArrayPool {
+public:
+    static ArrayPool& instance() {
+        static ArrayPool pool;
+        return pool;
+    }
+
+    // An empty buffer with room for at least size bytes, the smallest pooled one that fits.
+    std::vector<uint8_t> acquire(size_t size) {
+        std::vector<uint8_t> buffer;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            size_t best = buffers.size();
+            for (size_t i = 0; i < buffers.size(); ++i) {
+                if (buffers[i].capacity() >= size &&
+                    (best == buffers.size() || buffers[i].capacity() < buffers[best].capacity())) {
+                    best = i;
+                }
+            }
+            if (best < buffers.size()) {
+                bytes -= buffers[best].capacity();
+                buffer = std::move(buffers[best]);
+                buffers[best] = std::move(buffers.back());
+                buffers.pop_back();
+            }
+        }
+        buffer.reserve(size);
+        return buffer;
+    }
+
+    // Keeps the buffer for reuse unless the pool is full.
+    void release(std::vector<uint8_t>&& buffer) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (buffer.capacity() == 0 || buffers.size() >= max_buffers || bytes + buffer.capacity() > max_bytes) {
+            return;
+        }
+        buffer.clear();
+        bytes += buffer.capacity();
+        buffers.push_back(std::move(buffer));
+    }
+
+    size_t max_buffers = 16;
+    size_t max_bytes = 256 << 20;
+
+private:
+    std::mutex mutex;
+    std::vector<std::vector<uint8_t>> buffers;
+    size_t bytes = 0;
+};
+
+}  // namespace pyhandler
@@ -1,20 +1,46 @@
 #pragma once
 
+#ifdef PYHANDLER_EMBEDDED
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#endif
+
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
 #include <queue>
+#include <set>
 #include <vector>
 
 #include "nlohmann/json.hpp"
 
 #include "pyhandler/base64.hpp"
+#include "pyhandler/cache.hpp"
+#include "pyhandler/columns.hpp"
 #include "pyhandler/concurrent.hpp"
+#include "pyhandler/pool.hpp"
 
 namespace pyhandler {
 
 using json = nlohmann::json;
 
+class TimeoutError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class NDArray {
 public:
     NDArray() {
@@ -29,6 +55,12 @@ public:
         this->dtype = dtype;
     }
 
+    NDArray(std::vector<uint8_t>&& data, const std::vector<size_t>& shape, const std::string& dtype) {
+        this->data = std::move(data);
+        this->shape = shape;
+        this->dtype = dtype;
+    }
+
     NDArray(const int* data, const std::vector<size_t>& shape) {
         this->shape = shape;
         this->dtype = "int32";
@@ -83,6 +115,28 @@ public:
     std::string dtype;
 };
 
+// Arrays handed to an in-process interpreter by reference instead of being encoded into the message.
+struct SharedArrays {
+    std::vector<const NDArray*> params;
+    std::vector<std::vector<uint8_t>> results;
+    size_t min_bytes = 0;
+
+    static SharedArrays*& current() {
+        static thread_local SharedArrays* arrays = nullptr;
+        return arrays;
+    }
+
+    class Scope {
+    public:
+        explicit Scope(SharedArrays* arrays) : prev(current()) { current() = arrays; }
+
+        ~Scope() { current() = prev; }
+
+    private:
+        SharedArrays* prev;
+    };
+};
+
 template <class Param>
 struct ParamEncoder {
     static inline json impl(const Param& param) { throw std::runtime_error("Unknown param type"); }
@@ -111,6 +165,15 @@ struct ParamEncoder<float> {
 template <>
 struct ParamEncoder<NDArray> {
     static inline json impl(const NDArray& param) {
+        SharedArrays* arrays = SharedArrays::current();
+        if (arrays && param.data.size() >= arrays->min_bytes) {
+            arrays->params.push_back(&param);
+            return json::object(
+                    {{"class", "buffer"},
+                     {"index", arrays->params.size() - 1},
+                     {"dtype", param.dtype},
+                     {"shape", param.shape}});
+        }
         return json::object(
                 {{"class", "ndarray"},
                  {"data", base64_encode(param.data)},
@@ -132,6 +195,12 @@ struct ParamEncoder<const char*> {
 template <class T>
 struct ParamEncoder<std::vector<T>> {
     static inline json impl(const std::vector<T>& param) {
+        return impl(param, std::integral_constant<bool, ColumnTraits<T>::defined>());
+    }
+
+    static inline json impl(const std::vector<T>& param, std::true_type) { return encode_columns(param); }
+
+    static inline json impl(const std::vector<T>& param, std::false_type) {
         json j = json::array();
         for (const auto& item : param) {
             j.push_back(ParamEncoder<typename std::remove_reference<T>::type>::impl(item));
@@ -155,8 +224,8 @@ template <size_t I, size_t N>
 struct TupleEncoder {
     template <class... T>
     static void impl(const std::tuple<T...>& t, json& v) {
-        v.push_back(ParamEncoder<typename std::remove_reference<
-                            typename std::tuple_element<I, std::tuple<T...>>::type>::type>::impl(std::get<I>(t)));
+        v.push_back(ParamEncoder<typename std::decay<typename std::tuple_element<I, std::tuple<T...>>::type>::type>::impl(
+                std::get<I>(t)));
         TupleEncoder<I + 1, N>::impl(t, v);
     }
 };
@@ -176,6 +245,259 @@ struct ParamEncoder<std::tuple<T...>> {
     }
 };
 
+template <class... Param>
+json encode_params(const Param&... params) {
+    return ParamEncoder<std::tuple<const Param&...>>::impl(std::tie(params...));
+}
+
+// Well-formed UTF-8 as nlohmann::json accepts it: no overlong forms, surrogates or code points past U+10FFFF.
+inline bool is_valid_utf8(const char* str, size_t size) {
+    size_t i = 0;
+    while (i < size) {
+        unsigned char c = str[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        size_t len;
+        uint32_t code;
+        if (c >= 0xc2 && c <= 0xdf) {
+            len = 2;
+            code = c & 0x1f;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            len = 3;
+            code = c & 0x0f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            len = 4;
+            code = c & 0x07;
+        } else {
+            return false;
+        }
+        if (i + len > size) {
+            return false;
+        }
+        for (size_t k = 1; k < len; ++k) {
+            unsigned char cc = str[i + k];
+            if ((cc & 0xc0) != 0x80) {
+                return false;
+            }
+            code = (code << 6) | (cc & 0x3f);
+        }
+        if ((len == 3 && (code < 0x800 || (code >= 0xd800 && code <= 0xdfff))) ||
+            (len == 4 && (code < 0x10000 || code > 0x10ffff))) {
+            return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+// Invalid UTF-8 throws the json::type_error dump() would, the child reads commands as UTF-8 text.
+inline void write_json_string(std::string& out, const char* str, size_t size) {
+    static const char hex[] = "0123456789abcdef";
+    if (!is_valid_utf8(str, size)) {
+        json(std::string(str, size)).dump();
+    }
+    out += '"';
+    for (const char* end = str + size; str != end; ++str) {
+        char c = *str;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            out += "\\u00";
+            out += hex[(c >> 4) & 0xf];
+            out += hex[c & 0xf];
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+inline void write_json_string(std::string& out, const std::string& str) {
+    write_json_string(out, str.data(), str.size());
+}
+
+inline void write_json_number(std::string& out, long long value) {
+    char buf[32];
+    out.append(buf, snprintf(buf, sizeof(buf), "%lld", value));
+}
+
+// NaN and infinities are written the way Python's json module reads them.
+inline void write_json_number(std::string& out, double value) {
+    if (std::isnan(value)) {
+        out += "NaN";
+    } else if (std::isinf(value)) {
+        out += value > 0 ? "Infinity" : "-Infinity";
+    } else {
+        char buf[32];
+        int size = snprintf(buf, sizeof(buf), "%.17g", value);
+        std::replace(buf, buf + size, ',', '.');
+        out.append(buf, size);
+    }
+}
+
+// Appends the encoding of a param to out without building a json tree. Types without a specialization fall back to
+// ParamEncoder.
+template <class Param>
+struct ParamWriter {
+    static inline void impl(std::string& out, const Param& param) { out += ParamEncoder<Param>::impl(param).dump(); }
+};
+
+template <>
+struct ParamWriter<long long> {
+    static inline void impl(std::string& out, long long param) {
+        out += "{\"class\":\"int\",\"value\":";
+        write_json_number(out, param);
+        out += '}';
+    }
+};
+
+template <>
+struct ParamWriter<int> {
+    static inline void impl(std::string& out, int param) { ParamWriter<long long>::impl(out, param); }
+};
+
+template <>
+struct ParamWriter<double> {
+    static inline void impl(std::string& out, double param) {
+        out += "{\"class\":\"float\",\"value\":";
+        write_json_number(out, param);
+        out += '}';
+    }
+};
+
+template <>
+struct ParamWriter<float> {
+    static inline void impl(std::string& out, float param) { ParamWriter<double>::impl(out, param); }
+};
+
+template <>
+struct ParamWriter<std::string> {
+    static inline void impl(std::string& out, const std::string& param) {
+        out += "{\"class\":\"string\",\"value\":";
+        write_json_string(out, param);
+        out += '}';
+    }
+};
+
+template <>
+struct ParamWriter<const char*> {
+    static inline void impl(std::string& out, const char* param) {
+        out += "{\"class\":\"string\",\"value\":";
+        write_json_string(out, param, strlen(param));
+        out += '}';
+    }
+};
+
+template <>
+struct ParamWriter<NDArray> {
+    static inline void impl(std::string& out, const NDArray& param) {
+        SharedArrays* arrays = SharedArrays::current();
+        if (arrays && param.data.size() >= arrays->min_bytes) {
+            out += ParamEncoder<NDArray>::impl(param).dump();
+            return;
+        }
+        out += "{\"class\":\"ndarray\",\"data\":\"";
+        base64_encode(param.data, out);
+        out += "\",\"dtype\":";
+        write_json_string(out, param.dtype);
+        out += ",\"shape\":[";
+        for (size_t i = 0; i < param.shape.size(); ++i) {
+            if (i) {
+                out += ',';
+            }
+            write_json_number(out, (long long)param.shape[i]);
+        }
+        out += "]}";
+    }
+};
+
+template <class T, size_t N>
+struct ParamWriter<std::array<T, N>> {
+    static inline void impl(std::string& out, const std::array<T, N>& param) {
+        out += "{\"class\":\"list\",\"value\":[";
+        for (size_t i = 0; i < N; ++i) {
+            if (i) {
+                out += ',';
+            }
+            ParamWriter<T>::impl(out, param[i]);
+        }
+        out += "]}";
+    }
+};
+
+// Writes ["call", func_name, params] straight into out, as the json built by encode_params would dump.
+template <class... Param>
+void write_call(std::string& out, const std::string& func_name, const Param&... params) {
+    out += "[\"call\",";
+    write_json_string(out, func_name);
+    out += ",{\"class\":\"list\",\"value\":[";
+    bool first = true;
+    int expand[] = {0,
+                    ((first ? (void)(first = false) : (void)(out += ',')),
+                     ParamWriter<typename std::decay<const Param&>::type>::impl(out, params),
+                     0)...};
+    (void)expand;
+    out += "]}]";
+}
+
+// Class of a reply. parse_reply keeps int, float and null replies as plain values instead of objects.
+inline const std::string& reply_class(const json& reply) {
+    static const std::string int_class = "int", float_class = "float", null_class = "null";
+    if (reply.is_number_integer()) {
+        return int_class;
+    } else if (reply.is_number_float()) {
+        return float_class;
+    } else if (reply.is_null()) {
+        return null_class;
+    }
+    return reply.at("class").get_ref<const std::string&>();
+}
+
+// Parses a reply line. Scalar replies, the common case, are read without building a json object. With arrays, an
+// inline ndarray reply is decoded straight into a pooled buffer appended to arrays->results and turned into a buffer
+// reply, so its payload never becomes a json string.
+inline json parse_reply(const std::string& line, SharedArrays* arrays = nullptr) {
+    static const std::string int_prefix = "{\"class\": \"int\", \"value\": ";
+    static const std::string float_prefix = "{\"class\": \"float\", \"value\": ";
+    static const std::string null_reply = "{\"class\": \"null\"}";
+    static const std::string ndarray_prefix = "{\"class\": \"ndarray\", \"data\": \"";
+    if (arrays && line.compare(0, ndarray_prefix.size(), ndarray_prefix) == 0) {
+        size_t start = ndarray_prefix.size();
+        size_t end = line.find('"', start);
+        if (end != std::string::npos && line.compare(end, 3, "\", ") == 0) {
+            json reply = json::parse("{" + line.substr(end + 3));
+            std::vector<uint8_t> data = ArrayPool::instance().acquire((end - start) / 4 * 3);
+            base64_decode(line.data() + start, end - start, data);
+            arrays->results.push_back(std::move(data));
+            reply["class"] = "buffer";
+            reply["index"] = arrays->results.size() - 1;
+            return reply;
+        }
+    }
+    if (line.size() > int_prefix.size() && line.back() == '}' && line.compare(0, int_prefix.size(), int_prefix) == 0) {
+        char* end;
+        errno = 0;
+        long long value = strtoll(line.c_str() + int_prefix.size(), &end, 10);
+        if (errno == 0 && end == &line.back()) {
+            return value;
+        }
+    } else if (
+            line.size() > float_prefix.size() && line.back() == '}' &&
+            line.compare(0, float_prefix.size(), float_prefix) == 0) {
+        char* end;
+        double value = strtod(line.c_str() + float_prefix.size(), &end);
+        if (end == &line.back()) {
+            return value;
+        }
+    } else if (line == null_reply) {
+        return nullptr;
+    }
+    return json::parse(line);
+}
+
 template <class S, class D>
 struct Cast {
     template <class T = D>
@@ -192,6 +514,8 @@ struct Cast {
 template <class S>
 struct Cast<S, S> {
     static S impl(const S& src) { return src; }
+
+    static S impl(S&& src) { return std::move(src); }
 };
 
 template <>
@@ -202,13 +526,26 @@ struct Cast<json, void> {
 template <class T>
 struct Cast<json, T> {
     static T impl(const json& result) {
-        std::string cls = result["class"];
-        if (cls == "int") {
+        const std::string& cls = reply_class(result);
+        if (result.is_number_integer()) {
+            return Cast<long long, T>::impl(result.get<long long>());
+        } else if (result.is_number_float()) {
+            return Cast<double, T>::impl(result.get<double>());
+        } else if (cls == "int") {
             return Cast<long long, T>::impl((long long)result["value"]);
         } else if (cls == "float") {
             return Cast<double, T>::impl((double)result["value"]);
         } else if (cls == "ndarray") {
-            return Cast<NDArray, T>::impl(NDArray(base64_decode(result["data"]), result["shape"], result["dtype"]));
+            const std::string& encoded = result["data"].get_ref<const std::string&>();
+            std::vector<uint8_t> data = ArrayPool::instance().acquire(encoded.size() / 4 * 3);
+            base64_decode(encoded, data);
+            return Cast<NDArray, T>::impl(NDArray(std::move(data), result["shape"], result["dtype"]));
+        } else if (cls == "buffer") {
+            if (!SharedArrays::current()) {
+                throw std::runtime_error("Array result outside of its call");
+            }
+            std::vector<uint8_t>& data = SharedArrays::current()->results.at(result["index"]);
+            return Cast<NDArray, T>::impl(NDArray(std::move(data), result["shape"], result["dtype"]));
         } else if (cls == "string") {
             return Cast<std::string, T>::impl(std::string(result["value"]));
         } else {
@@ -220,23 +557,31 @@ struct Cast<json, T> {
 template <class V>
 struct Cast<json, std::vector<V>> {
     static std::vector<V> impl(const json& result) {
-        std::string cls = result["class"];
+        const std::string& cls = reply_class(result);
         if (cls == "list") {
             std::vector<V> v;
             for (json el : result["value"]) {
                 v.push_back(Cast<json, V>::impl(el));
             }
             return v;
+        } else if (cls == "columns") {
+            return from_columns(result, std::integral_constant<bool, ColumnTraits<V>::defined>());
         } else {
             throw std::runtime_error("Unknown result type");
         }
     }
+
+    static std::vector<V> from_columns(const json& result, std::true_type) { return decode_columns<V>(result); }
+
+    static std::vector<V> from_columns(const json& result, std::false_type) {
+        throw std::runtime_error("Columns received for a type without PYHANDLER_COLUMNS");
+    }
 };
 
 template <class V>
 struct Cast<json, std::map<std::string, V>> {
     static std::map<std::string, V> impl(const json& result) {
-        std::string cls = result["class"];
+        const std::string& cls = reply_class(result);
         if (cls == "dict") {
             std::map<std::string, V> m;
             for (auto& el : result["value"].items()) {
@@ -269,7 +614,7 @@ struct TupleAssigner<N, N> {
 template <class... V>
 struct Cast<json, std::tuple<V...>> {
     static std::tuple<V...> impl(const json& result) {
-        std::string cls = result["class"];
+        const std::string& cls = reply_class(result);
         if (cls == "list") {
             std::tuple<V...> t;
             if (sizeof...(V) != result["value"].size()) {
@@ -283,65 +628,698 @@ struct Cast<json, std::tuple<V...>> {
     }
 };
 
-class PyHandler {
+class Backend {
+public:
+    virtual ~Backend() {}
+
+    // Starts a fresh interpreter, dropping the state of the previous one.
+    virtual void start() = 0;
+
+    // Returns false when the deadline passes before anything was written, the interpreter is untouched then. Throws
+    // TimeoutError when it passes with msg partly written, and runtime_error when the interpreter is gone.
+    virtual bool write(const std::string& msg, Clock::time_point deadline) = 0;
+
+    virtual bool read(std::string& msg, Clock::time_point deadline) = 0;
+
+    // Asks the running command to stop, its reply still has to be read. Returns false when it can not be stopped.
+    virtual bool interrupt() = 0;
+
+    // Stops the interpreter. A read running on another thread returns or throws shortly after, start() is only called
+    // once it has.
+    virtual void kill() = 0;
+
+    // Whether NDArray params and results are passed out of band through SharedArrays.
+    virtual bool shares_arrays() const { return false; }
+
+    virtual size_t min_shared_bytes() const { return 0; }
+
+    // A new backend of the same kind for recycling, nullptr when the interpreter can not be replaced.
+    virtual std::shared_ptr<Backend> clone() const { return nullptr; }
+
+    // Resident set size of the interpreter process in bytes, 0 when unknown.
+    virtual size_t rss() const { return 0; }
+};
+
+class ProcessBackend : public Backend {
+public:
+    // The interpreter is bound to the CPUs of slot, e.g. Placement::spread().slot(i) for the i-th handler.
+    explicit ProcessBackend(const CpuSlot& slot = CpuSlot()) : slot(slot) { start(); }
+
+    ~ProcessBackend() { process->write_to_proc("EXIT"); }
+
+    // The child is forked from ForkThread. Other threads keep running during the fork, so the command line is built
+    // beforehand and the child does not allocate.
+    void start() override {
+        process = std::make_shared<Process>();
+        process->place(slot);
+        std::array<int, 2> io_pipe = process->child_io_pipe();
+        command =
+#include "pyhandler.py"
+                ;
+        command += "\n__main(" + std::to_string(io_pipe[0]) + ", " + std::to_string(io_pipe[1]) + ")\n";
+        const char* cmd = command.c_str();
+        ForkThread::instance().run([this, cmd]() {
+            process->start([cmd](std::array<int, 2>) {
+                return execl("/usr/bin/python3", "/usr/bin/python3", "-c", cmd, (char*)NULL);
+            });
+        });
+    }
+
+    bool write(const std::string& msg, Clock::time_point deadline) override {
+        bool written = false;
+        if (!process->write_to_proc(msg, deadline, &written)) {
+            if (!process->is_alive()) {
+                throw std::runtime_error("Process failed");
+            } else if (written) {
+                throw TimeoutError("Deadline exceeded");
+            }
+            return false;
+        }
+        return true;
+    }
+
+    bool read(std::string& msg, Clock::time_point deadline) override {
+        if (!process->read_from_proc(msg, deadline)) {
+            if (process->is_alive()) {
+                return false;
+            }
+            throw std::runtime_error("Process failed");
+        }
+        return true;
+    }
+
+    bool interrupt() override {
+        process->kill(SIGINT);
+        return true;
+    }
+
+    void kill() override { process->kill(SIGKILL); }
+
+    WorkerPlacement placement() const { return process->placement(); }
+
+    std::shared_ptr<Backend> clone() const override { return std::make_shared<ProcessBackend>(slot); }
+
+    size_t rss() const override { return process->rss(); }
+
+    std::shared_ptr<Process> process;
+    std::string command;
+    CpuSlot slot;
+};
+
+// Connects to a shared interpreter started with `python3 pyhandler.py --serve <path>`. Large arrays are passed as
+// memfds. Commands that miss their deadline drop the connection, the next command reconnects.
+class SocketBackend : public Backend {
+public:
+    explicit SocketBackend(const std::string& path) : path(path) { start(); }
+
+    void start() override { socket = std::make_shared<UnixSocket>(path); }
+
+    bool write(const std::string& msg, Clock::time_point deadline) override {
+        std::vector<int> fds;
+        SharedArrays* arrays = SharedArrays::current();
+        for (size_t i = 0; arrays && i < arrays->params.size(); ++i) {
+            fds.push_back(write_memfd(arrays->params[i]->data));
+        }
+        bool success = false;
+        bool written = false;
+        try {
+            success = socket->write_to_server(msg, fds, deadline, &written);
+        } catch (...) {
+            close_fds(fds);
+            throw;
+        }
+        close_fds(fds);
+        if (!success && !socket->is_connected()) {
+            throw std::runtime_error("Server disconnected");
+        } else if (!success && written) {
+            throw TimeoutError("Deadline exceeded");
+        }
+        return success;
+    }
+
+    bool read(std::string& msg, Clock::time_point deadline) override {
+        std::vector<int> fds;
+        if (!socket->read_from_server(msg, fds, deadline)) {
+            if (!socket->is_connected()) {
+                throw std::runtime_error("Server disconnected");
+            }
+            return false;
+        }
+        SharedArrays* arrays = SharedArrays::current();
+        for (size_t i = 0; arrays && i < fds.size(); ++i) {
+            arrays->results.push_back(read_memfd(fds[i]));
+        }
+        close_fds(fds);
+        return true;
+    }
+
+    // The server is shared, so a running command can not be interrupted on behalf of one client.
+    bool interrupt() override { return false; }
+
+    // The socket is kept until start() replaces it, a reader still inside it wakes up disconnected.
+    void kill() override { socket->shutdown(); }
+
+    bool shares_arrays() const override { return true; }
+
+    size_t min_shared_bytes() const override { return 1 << 16; }
+
+private:
+    static void close_fds(const std::vector<int>& fds) {
+        for (int fd : fds) {
+            close(fd);
+        }
+    }
+
+    std::string path;
+    std::shared_ptr<UnixSocket> socket;
+};
+
+}  // namespace pyhandler
+
+#ifdef PYHANDLER_EMBEDDED
+#include "pyhandler/embedded.hpp"
+#endif
+
+namespace pyhandler {
+
+inline std::shared_ptr<Backend> default_backend() {
+    if (const char* path = getenv("PYHANDLER_SOCKET")) {
+        return std::make_shared<SocketBackend>(path);
+    }
+#ifdef PYHANDLER_EMBEDDED
+    return std::make_shared<EmbeddedBackend>();
+#else
+    return std::make_shared<ProcessBackend>();
+#endif
+}
+
+template <class T>
+class Stream;
+
+class PyHandler : public std::enable_shared_from_this<PyHandler> {
 public:
     static std::shared_ptr<PyHandler> instance() {
         static std::shared_ptr<PyHandler> instance;
         if (!instance) {
-            instance.reset(new PyHandler());
+            instance = create(default_backend());
         }
         return instance;
     }
 
+    static std::shared_ptr<PyHandler> create(std::shared_ptr<Backend> backend) {
+        return std::shared_ptr<PyHandler>(new PyHandler(backend));
+    }
+
 private:
-    PyHandler() {
-        process = std::make_shared<Process>();
-        func = [](std::array<int, 2> io_pipe) {
-            std::string cmd =
-#include "pyhandler.py"
-                    ;
-            cmd = cmd + "\n__main(" + std::to_string(io_pipe[0]) + ", " + std::to_string(io_pipe[1]) + ")\n";
-            return execl("/usr/bin/python3", "/usr/bin/python3", "-c", cmd.c_str(), (char*)NULL);
-        };
-        process->start(func);
+    explicit PyHandler(std::shared_ptr<Backend> backend) : backend(backend) {}
+
+    bool send(const json& data, Clock::time_point deadline = Clock::time_point::max()) {
+        return backend->write(data.dump(), deadline);
     }
 
+    // A caller queued behind a slow command gives up at its deadline instead of waiting for the handler.
+    std::unique_lock<std::timed_mutex> lock_until(Clock::time_point deadline) {
+        std::unique_lock<std::timed_mutex> lock(mutex, std::defer_lock);
+        if (deadline == Clock::time_point::max()) {
+            lock.lock();
+        } else if (!lock.try_lock_until(deadline)) {
+            throw TimeoutError("Deadline exceeded");
+        }
+        return lock;
+    }
+
+    // Reads the next reply to the command in progress. Replies of finished async calls read on the way are kept for
+    // their callers.
+    bool receive(json& data, Clock::time_point deadline = Clock::time_point::max()) {
+        if (!await_reply([this]() { return replies_head < replies.size(); }, deadline)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(reply_mutex);
+        data = std::move(replies[replies_head++]);
+        if (replies_head == replies.size()) {
+            replies.clear();
+            replies_head = 0;
+        }
+        return true;
+    }
+
+    json receive() {
+        json data;
+        receive(data);
+        return data;
+    }
+
+    // Array results are always received into the SharedArrays of the call. Array params only go out of band when
+    // the backend supports it.
+    SharedArrays shared_arrays() const {
+        SharedArrays arrays;
+        arrays.min_bytes = backend->shares_arrays() ? backend->min_shared_bytes() : SIZE_MAX;
+        return arrays;
+    }
+
+    static bool is_preload(const json& data) { return data[0] == "set_vars" || data[0] == "exec_file"; }
+
     template <class Result>
-    Result execute_with_data(json& data) {
-        std::string result;
-        if (!process->communicate_to_proc(data.dump(), result)) {
-            throw std::runtime_error("Process failed");
+    Result execute_with_data(json& data, Clock::time_point deadline = Clock::time_point::max()) {
+        return Cast<json, Result>::impl(execute(data, deadline));
+    }
+
+    // Waits until ready() holds. Whichever waiting thread gets there first reads from the backend and routes what it
+    // reads, so replies of async calls never block the command in progress and vice versa.
+    template <class Ready>
+    bool await_reply(const Ready& ready, Clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(reply_mutex);
+        while (!ready()) {
+            if (reading) {
+                if (deadline == Clock::time_point::max()) {
+                    reply_cond.wait(lock);
+                } else if (reply_cond.wait_until(lock, deadline) == std::cv_status::timeout) {
+                    return ready();
+                }
+                continue;
+            }
+            reading = true;
+            SharedArrays* arrays = reply_arrays;
+            lock.unlock();
+            bool success = false;
+            try {
+                SharedArrays::Scope scope(arrays);
+                success = backend->read(receive_buffer, deadline);
+            } catch (...) {
+                lock.lock();
+                reading = false;
+                reply_cond.notify_all();
+                throw;
+            }
+            lock.lock();
+            reading = false;
+            if (success) {
+                route(parse_reply(receive_buffer, reply_arrays));
+            }
+            reply_cond.notify_all();
+            if (!success) {
+                return ready();
+            }
+        }
+        return true;
+    }
+
+    void route(json reply) {
+        if (reply_class(reply) != "done") {
+            replies.push_back(std::move(reply));
+            return;
+        }
+        int64_t id = reply["id"];
+        if (!abandoned.erase(id)) {
+            completed[id] = std::move(reply);
+        }
+    }
+
+    json execute(json& data, Clock::time_point deadline) {
+        return execute([&data](std::string& out) { out = data.dump(); }, is_preload(data) ? &data : nullptr, deadline);
+    }
+
+    template <class Writer>
+    json execute(const Writer& write_command, const json* preload_command, Clock::time_point deadline) {
+        json result = run_command(write_command, preload_command, deadline);
+        if (reply_class(result) == "pending") {
+            result = await_call(result["id"], result["generation"], deadline);
+        }
+        return result;
+    }
+
+    // Waits for an async call started by run_command, cancelling it when the deadline passes first. The cancel is
+    // only sent right away when no other command runs, otherwise the next command sends it.
+    json await_call(int64_t id, size_t call_generation, Clock::time_point deadline) {
+        PendingCall pending(this);
+        auto ready = [&]() { return completed.count(id) || generation != call_generation; };
+        bool success;
+        try {
+            success = await_reply(ready, deadline);
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(reply_mutex);
+            if (killed || generation != call_generation) {
+                throw std::runtime_error("Interpreter restarted");
+            }
+            throw;
+        }
+        if (!success) {
+            {
+                std::lock_guard<std::mutex> guard(reply_mutex);
+                if (generation != call_generation || (killed && Clock::now() < deadline)) {
+                    throw std::runtime_error("Interpreter restarted");
+                }
+                if (!completed.erase(id) && !killed) {
+                    abandoned.insert(id);
+                    cancels.push_back(id);
+                }
+            }
+            std::unique_lock<std::timed_mutex> guard(mutex, std::try_to_lock);
+            if (guard.owns_lock()) {
+                try {
+                    send_cancels();
+                } catch (...) {
+                    kill();
+                }
+            }
+            throw TimeoutError("Deadline exceeded");
+        }
+        std::lock_guard<std::mutex> guard(reply_mutex);
+        if (generation != call_generation) {
+            throw std::runtime_error("Interpreter restarted");
+        }
+        json reply = std::move(completed[id]);
+        completed.erase(id);
+        if (reply.contains("error")) {
+            throw std::runtime_error(reply["error"].get<std::string>());
+        }
+        return reply["result"];
+    }
+
+    // The command is written into send_buffer, which keeps its capacity from one command to the next.
+    template <class Writer>
+    json run_command(const Writer& write_command, const json* preload_command, Clock::time_point deadline) {
+        std::unique_lock<std::timed_mutex> guard = lock_until(deadline);
+        if (streaming) {
+            throw std::runtime_error("Stream in progress");
+        }
+        if (Clock::now() >= deadline) {
+            throw TimeoutError("Deadline exceeded");
+        }
+        if (killed) {
+            respawn(deadline);
+        }
+        try {
+            send_cancels();
+        } catch (...) {
+            kill();
+            throw;
+        }
+        swap_backend();
+        ReplyArrays reply_scope(this);
+        json result;
+        send_buffer.clear();
+        write_command(send_buffer);
+        bool success;
+        try {
+            success = backend->write(send_buffer, deadline);
+        } catch (...) {
+            kill();
+            throw;
+        }
+        if (!success) {
+            throw TimeoutError("Deadline exceeded");
+        }
+        try {
+            success = receive(result, deadline);
+        } catch (...) {
+            kill();
+            throw;
+        }
+        if (!success) {
+            interrupt();
+            throw TimeoutError("Deadline exceeded");
+        }
+        const std::string& cls = reply_class(result);
+        if (cls == "interrupted") {
+            throw TimeoutError("Deadline exceeded");
+        } else if (cls == "error") {
+            throw std::runtime_error(result["message"].get<std::string>());
+        } else if (cls == "pending") {
+            std::lock_guard<std::mutex> reply_guard(reply_mutex);
+            result["generation"] = generation;
+            pending_calls++;
+        }
+        if (preload_command) {
+            const json& data = *preload_command;
+            add_preload(data);
+            if (data[0] == "exec_file" ? cache.policy.invalidate_on_exec_file : cache.policy.invalidate_on_set_vars) {
+                cache.clear();
+            }
+        }
+        request_recycle();
+        return result;
+    }
+
+    // Keeps what a replay needs: every exec_file, and of the variables set since the last one only their latest
+    // values, so repeating set_vars does not grow the preload.
+    void add_preload(const json& data) {
+        if (data[0] == "set_vars") {
+            for (size_t i = preload.size(); i > 0 && preload[i - 1].command[0] == "set_vars"; --i) {
+                json& names = preload[i - 1].command[1];
+                json& values = preload[i - 1].command[2]["value"];
+                for (size_t j = names.size(); j > 0; --j) {
+                    if (std::find(data[1].begin(), data[1].end(), names[j - 1]) != data[1].end()) {
+                        names.erase(j - 1);
+                        values.erase(j - 1);
+                    }
+                }
+            }
+            preload.erase(
+                    std::remove_if(
+                            preload.begin(), preload.end(),
+                            [](const Preload& entry) { return entry.command[0] == "set_vars" && entry.command[1].empty(); }),
+                    preload.end());
+        }
+        preload.push_back({preload_seq++, data});
+    }
+
+    // Cancels of async calls whose callers gave up. They go to the interpreter the calls run in, so they are sent
+    // before a recycle swaps it. The interpreter does not reply to them.
+    void send_cancels() {
+        std::vector<int64_t> ids;
+        {
+            std::lock_guard<std::mutex> guard(reply_mutex);
+            if (cancels.empty()) {
+                return;
+            }
+            ids.swap(cancels);
+        }
+        for (int64_t id : ids) {
+            send(json::array({"cancel", id}));
+        }
+    }
+
+    // Asks the recycler thread for a warm replacement once the interpreter is over the limits of the recycle policy.
+    void request_recycle() {
+        calls++;
+        if (!recycle.due(calls, Clock::now() - started, recycle.max_rss ? backend->rss() : 0)) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(recycle_mutex);
+        if (warm_requested || replacement || !recyclable) {
+            return;
+        }
+        warm_requested = true;
+        warm_prototype = backend;
+        warm_preload = preload;
+        if (!recycler.joinable()) {
+            recycler = std::thread(&PyHandler::run_recycler, this);
+        }
+        recycle_cond.notify_all();
+    }
+
+    // Starts replacements and replays the preload into them, so callers do not wait for the interpreter to warm up.
+    void run_recycler() {
+        std::unique_lock<std::mutex> lock(recycle_mutex);
+        while (true) {
+            recycle_cond.wait(lock, [this]() { return warm_requested || stopping; });
+            if (stopping) {
+                return;
+            }
+            std::shared_ptr<Backend> prototype = std::move(warm_prototype);
+            std::vector<Preload> commands = std::move(warm_preload);
+            lock.unlock();
+            std::shared_ptr<Backend> fresh;
+            bool supported = true;
+            try {
+                fresh = prototype->clone();
+                supported = fresh != nullptr;
+                for (size_t i = 0; fresh && i < commands.size(); ++i) {
+                    std::string reply;
+                    fresh->write(commands[i].command.dump(), Clock::time_point::max());
+                    fresh->read(reply, Clock::time_point::max());
+                    if (json::parse(reply)["class"] == "error") {
+                        fresh = nullptr;
+                    }
+                }
+            } catch (...) {
+                fresh = nullptr;
+            }
+            prototype = nullptr;
+            lock.lock();
+            recyclable = supported;
+            warm_requested = false;
+            replacement = fresh;
+            replacement_preload = commands.empty() ? 0 : commands.back().seq + 1;
+        }
+    }
+
+    // Swaps in a warm replacement once no async call waits on the current interpreter. The old one is retired in the
+    // background so the caller does not wait for it to exit.
+    void swap_backend() {
+        std::shared_ptr<Backend> fresh;
+        size_t replayed;
+        {
+            std::lock_guard<std::mutex> guard(recycle_mutex);
+            if (!replacement) {
+                return;
+            }
+            std::lock_guard<std::mutex> reply_guard(reply_mutex);
+            if (reading || pending_calls) {
+                return;
+            }
+            fresh = std::move(replacement);
+            replayed = replacement_preload;
+            // Ids of async calls start over in the fresh interpreter.
+            completed.clear();
+            abandoned.clear();
+        }
+        for (const auto& entry : preload) {
+            if (entry.seq < replayed) {
+                continue;
+            }
+            std::string reply;
+            fresh->write(entry.command.dump(), Clock::time_point::max());
+            fresh->read(reply, Clock::time_point::max());
+        }
+        std::thread([](std::shared_ptr<Backend> old) { old.reset(); }, std::move(backend)).detach();
+        backend = fresh;
+        calls = 0;
+        started = Clock::now();
+        recycles++;
+    }
+
+    // Raises KeyboardInterrupt in the running command, the child is killed if it does not answer in time and
+    // respawned by the next command.
+    void interrupt() {
+        json reply;
+        if (!backend->interrupt() || !receive(reply, Clock::now() + interrupt_grace)) {
+            kill();
         }
-        return Cast<json, Result>::impl(json::parse(result));
     }
 
+    // Waits for a thread reading replies of async calls to leave the backend, so it is not torn down under it.
+    void kill() {
+        killed = true;
+        backend->kill();
+        std::unique_lock<std::mutex> lock(reply_mutex);
+        reply_cond.wait(lock, [this]() { return !reading; });
+    }
+
+    // Async calls still running in the old interpreter fail with "Interpreter restarted". A replay that misses the
+    // deadline leaves the handler killed, the next command starts over.
+    void respawn(Clock::time_point deadline = Clock::time_point::max()) {
+        calls = 0;
+        started = Clock::now();
+        {
+            std::unique_lock<std::mutex> lock(reply_mutex);
+            reply_cond.wait(lock, [this]() { return !reading; });
+            generation++;
+            replies.clear();
+            replies_head = 0;
+            completed.clear();
+            abandoned.clear();
+            cancels.clear();
+            reply_cond.notify_all();
+        }
+        backend->start();
+        bool success = true;
+        try {
+            json reply;
+            for (size_t i = 0; success && i < preload.size(); ++i) {
+                success = send(preload[i].command, deadline) && receive(reply, deadline);
+            }
+        } catch (...) {
+            kill();
+            throw;
+        }
+        if (!success) {
+            kill();
+            throw TimeoutError("Deadline exceeded");
+        }
+        // Only once the replay went through, a failed start is retried by the next command.
+        killed = false;
+    }
+
+    // Counts an async call as pending while its caller waits for it, however the wait ends. A recycle waits for
+    // none to be pending.
+    struct PendingCall {
+        explicit PendingCall(PyHandler* handler) : handler(handler) {}
+
+        ~PendingCall() {
+            std::lock_guard<std::mutex> guard(handler->reply_mutex);
+            handler->pending_calls--;
+        }
+
+        PyHandler* handler;
+    };
+
+    // Reads done while a command runs deliver its out of band arrays to the command's SharedArrays, whichever thread
+    // does the reading.
+    struct ReplyArrays {
+        explicit ReplyArrays(PyHandler* handler) : handler(handler) {
+            std::lock_guard<std::mutex> guard(handler->reply_mutex);
+            handler->reply_arrays = SharedArrays::current();
+        }
+
+        ~ReplyArrays() {
+            std::lock_guard<std::mutex> guard(handler->reply_mutex);
+            handler->reply_arrays = nullptr;
+        }
+
+        PyHandler* handler;
+    };
+
+    template <class T>
+    friend class Stream;
+
 public:
     PyHandler(PyHandler const&) = delete;
     void operator=(PyHandler const&) = delete;
 
     virtual ~PyHandler() {
-        process->write_to_proc("EXIT");
-        process.reset();
+        {
+            std::lock_guard<std::mutex> guard(recycle_mutex);
+            stopping = true;
+            recycle_cond.notify_all();
+        }
+        if (recycler.joinable()) {
+            recycler.join();
+        }
     }
 
     template <class Result, class... Param>
     Result call(const std::string& func_name, const Param&... params) {
-        json jparams = ParamEncoder<decltype(std::make_tuple(params...))>::impl(std::make_tuple(params...));
-        json jcommand = json::array({"call", func_name, jparams});
-        return this->execute_with_data<Result>(jcommand);
+        return call_until<Result>(Clock::time_point::max(), func_name, params...);
     }
 
     template <class... Param, size_t N = sizeof...(Param)>
     void set_vars(const std::array<std::string, N>& param_names, const Param&... params) {
-        json jparams = ParamEncoder<decltype(std::make_tuple(params...))>::impl(std::make_tuple(params...));
+        json jparams = encode_params(params...);
         json jcommand = json::array({"set_vars", param_names, jparams});
         this->execute_with_data<void>(jcommand);
     }
 
     template <class Result>
     Result exec(const std::string& code, const std::string& result_expr) {
+        return exec_until<Result>(Clock::time_point::max(), code, result_expr);
+    }
+
+    template <class Result, class... Param>
+    Result call_until(Clock::time_point deadline, const std::string& func_name, const Param&... params) {
+        SharedArrays arrays = shared_arrays();
+        SharedArrays::Scope scope(&arrays);
+        auto write_command = [&](std::string& out) { write_call(out, func_name, params...); };
+        return Cast<json, Result>::impl(execute(write_command, nullptr, deadline));
+    }
+
+    template <class Result>
+    Result exec_until(Clock::time_point deadline, const std::string& code, const std::string& result_expr) {
+        SharedArrays arrays = shared_arrays();
+        SharedArrays::Scope scope(&arrays);
         json jcommand = json::array({"exec", code, result_expr});
-        return this->execute_with_data<Result>(jcommand);
+        return this->execute_with_data<Result>(jcommand, deadline);
     }
 
     void exec_file(const std::string& file_path) {
@@ -349,10 +1327,226 @@ public:
         return this->execute_with_data<void>(jcommand);
     }
 
-    std::shared_ptr<Process> process;
-    std::function<int(std::array<int, 2>)> func;
+    // Only for pure functions, repeated arguments are answered from the cache without reaching the interpreter.
+    template <class Result, class... Param>
+    Result call_cached(const std::string& func_name, const Param&... params) {
+        SharedArrays::Scope scope(nullptr);
+        json jcommand = json::array({"call_cached", func_name, encode_params(params...)});
+        std::string key = jcommand.dump();
+        json result;
+        if (!cache.get(key, result)) {
+            size_t epoch = cache.get_epoch();
+            result = execute(jcommand, Clock::time_point::max());
+            cache.put(key, result, epoch);
+        }
+        return Cast<json, Result>::impl(result);
+    }
+
+    template <class T, class... Param>
+    Stream<T> stream(const std::string& func_name, const Param&... params);
+
+    std::shared_ptr<Backend> backend;
+    ResultCache cache;
+    size_t stream_chunk_size = 64;
+    size_t stream_credits = 4;
+    std::chrono::milliseconds interrupt_grace{100};
+    // Only applies to backends that can be cloned, i.e. ProcessBackend.
+    RecyclePolicy recycle;
+    size_t recycles = 0;
+
+private:
+    std::timed_mutex mutex;
+    // Commands replayed into a fresh interpreter, seq orders them across recycles.
+    struct Preload {
+        size_t seq;
+        json command;
+    };
+    std::vector<Preload> preload;
+    size_t preload_seq = 0;
+    bool streaming = false;
+    // Also read by threads waiting for async calls, which tell a restart from a failure by it.
+    std::atomic<bool> killed{false};
+
+    std::mutex reply_mutex;
+    std::condition_variable reply_cond;
+    bool reading = false;
+    // Replies to the command in progress, a vector drained from replies_head so steady calls do not allocate.
+    std::vector<json> replies;
+    size_t replies_head = 0;
+    std::string send_buffer;
+    std::string receive_buffer;
+    std::map<int64_t, json> completed;
+    std::set<int64_t> abandoned;
+    std::vector<int64_t> cancels;
+    size_t generation = 0;
+    SharedArrays* reply_arrays = nullptr;
+    size_t pending_calls = 0;
+
+    size_t calls = 0;
+    Clock::time_point started = Clock::now();
+    std::thread recycler;
+    std::mutex recycle_mutex;
+    std::condition_variable recycle_cond;
+    bool warm_requested = false;
+    bool stopping = false;
+    bool recyclable = true;
+    std::shared_ptr<Backend> warm_prototype;
+    std::vector<Preload> warm_preload;
+    std::shared_ptr<Backend> replacement;
+    size_t replacement_preload = 0;
+};
+
+template <class T>
+class Stream {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        explicit iterator(Stream* stream = nullptr) : stream(stream) {}
+
+        // Dereferencing fetches the next chunk when needed, so *begin() is valid without comparing to end() first.
+        reference operator*() const {
+            if (!stream->fill()) {
+                throw std::runtime_error("Dereferencing the end of a stream");
+            }
+            return stream->buffer.front();
+        }
+
+        pointer operator->() const { return &**this; }
+
+        iterator& operator++() {
+            if (stream->fill()) {
+                stream->buffer.pop_front();
+            }
+            return *this;
+        }
+
+        void operator++(int) { ++*this; }
+
+        bool operator==(const iterator& other) const { return at_end() == other.at_end(); }
+
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+
+    private:
+        bool at_end() const { return !stream || !stream->fill(); }
+
+        Stream* stream;
+    };
+
+    explicit Stream(std::shared_ptr<PyHandler> handler) : handler(handler), finished(false) {}
+
+    Stream(Stream&& other) : handler(std::move(other.handler)), buffer(std::move(other.buffer)) {
+        finished = other.finished;
+        other.finished = true;
+    }
+
+    Stream(Stream const&) = delete;
+    void operator=(Stream const&) = delete;
+
+    ~Stream() {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+
+    iterator begin() { return iterator(this); }
+
+    iterator end() { return iterator(); }
+
+    void close() {
+        if (finished) {
+            return;
+        }
+        std::lock_guard<std::timed_mutex> guard(handler->mutex);
+        try {
+            handler->send(json::array({"close"}));
+        } catch (...) {
+            fail();
+            throw;
+        }
+        while (!finished) {
+            fetch(false);
+        }
+        buffer.clear();
+    }
+
+private:
+    bool fill() {
+        if (!buffer.empty() || finished) {
+            return !buffer.empty();
+        }
+        std::lock_guard<std::timed_mutex> guard(handler->mutex);
+        while (buffer.empty() && !finished) {
+            fetch(true);
+        }
+        return !buffer.empty();
+    }
+
+    void fetch(bool keep) {
+        json chunk;
+        try {
+            chunk = handler->receive();
+        } catch (...) {
+            fail();
+            throw;
+        }
+        if (chunk["class"] == "stop" || chunk["class"] == "error") {
+            finished = true;
+            handler->streaming = false;
+            if (chunk["class"] == "error") {
+                throw std::runtime_error(chunk["message"].get<std::string>());
+            }
+            return;
+        }
+        if (keep) {
+            try {
+                handler->send(json::array({"credit", 1}));
+                for (auto& item : Cast<json, std::vector<T>>::impl(chunk)) {
+                    buffer.push_back(std::move(item));
+                }
+            } catch (...) {
+                fail();
+                throw;
+            }
+        }
+    }
+
+    // The stream broke off in an unknown state, the interpreter is respawned by the next command.
+    void fail() {
+        finished = true;
+        handler->streaming = false;
+        handler->kill();
+    }
+
+    std::shared_ptr<PyHandler> handler;
+    std::deque<T> buffer;
+    bool finished;
 };
 
+template <class T, class... Param>
+Stream<T> PyHandler::stream(const std::string& func_name, const Param&... params) {
+    std::lock_guard<std::timed_mutex> guard(mutex);
+    if (streaming) {
+        throw std::runtime_error("Stream in progress");
+    }
+    if (stream_chunk_size == 0 || stream_credits == 0) {
+        throw std::runtime_error("stream_chunk_size and stream_credits must be positive");
+    }
+    if (killed) {
+        respawn();
+    }
+    json jparams = encode_params(params...);
+    send(json::array({"stream", func_name, jparams, stream_chunk_size, stream_credits}));
+    streaming = true;
+    return Stream<T>(shared_from_this());
+}
+
 inline std::shared_ptr<PyHandler> get_handler() {
     return PyHandler::instance();
 }
@@ -367,6 +1561,21 @@ void call(const std::string& func_name, const Param&... params) {
     return get_handler()->call<void, Param...>(func_name, params...);
 }
 
+template <class T, class... Param>
+Stream<T> stream(const std::string& func_name, const Param&... params) {
+    return get_handler()->stream<T, Param...>(func_name, params...);
+}
+
+template <class Result, class... Param>
+Result call_cached(const std::string& func_name, const Param&... params) {
+    return get_handler()->call_cached<Result, Param...>(func_name, params...);
+}
+
+template <class Result, class... Param>
+Result call_until(Clock::time_point deadline, const std::string& func_name, const Param&... params) {
+    return get_handler()->call_until<Result, Param...>(deadline, func_name, params...);
+}
+
 template <class... Param, size_t N = sizeof...(Param)>
 void set_vars(const std::array<std::string, N>& param_names, const Param&... params) {
     get_handler()->set_vars<Param...>(param_names, params...);
@@ -382,6 +1591,11 @@ Result exec(const std::string& result_expr) {
     return get_handler()->exec<Result>("None", result_expr);
 }
 
+template <class Result>
+Result exec_until(Clock::time_point deadline, const std::string& code, const std::string& result_expr) {
+    return get_handler()->exec_until<Result>(deadline, code, result_expr);
+}
+
 void exec(const std::string& code) {
     get_handler()->exec<void>(code, "None");
 }
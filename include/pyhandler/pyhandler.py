@@ -3,14 +3,34 @@ R"PYHANDLER( # START"
 
 import os
 import json
+import itertools
 import math
+import mmap
+import queue
 import re
+import signal
+import socket
+import sys
+import threading
 import time
+import traceback
+import types
 import base64
 
 import numpy as np
 
 
+class __SharedArrays(threading.local):
+    # Arrays exchanged out of band by the command running on this thread, see __dispatch and __serve.
+    def __init__(self):
+        self.params = []
+        self.results = None
+        self.min_bytes = 0
+
+
+__shared = __SharedArrays()
+
+
 def __decode_param(param):
     cls = param['class']
     if cls == 'int':
@@ -19,10 +39,23 @@ def __decode_param(param):
         return float(param['value'])
     elif cls == 'ndarray':
         return np.frombuffer(base64.b64decode(param['data']), param['dtype']).reshape(param['shape'])
+    elif cls == 'buffer':
+        return np.frombuffer(__shared.params[param['index']], param['dtype']).reshape(param['shape'])
     elif cls == 'string':
         return param['value']
     elif cls == 'list':
         return [__decode_param(item) for item in param['value']]
+    elif cls == 'columns':
+        __columns = {
+            name: np.frombuffer(base64.b64decode(data), dtype)
+            for name, dtype, data in zip(param['names'], param['dtypes'], param['data'])
+        }
+        # pandas is imported late as it slows down the start of every interpreter.
+        try:
+            import pandas
+        except ImportError:
+            return __columns
+        return pandas.DataFrame(__columns, copy=False)
     elif cls == 'dict':
         return {k: __decode_param(v) for k, v in param['value']}
     else:
@@ -44,6 +77,18 @@ def __encode_result(result):
             'class': 'float',
             'value': result,
         }
+    elif isinstance(result, np.ndarray) and result.dtype.names is not None:
+        return __encode_columns([(name, result[name]) for name in result.dtype.names], len(result))
+    elif 'pandas' in sys.modules and isinstance(result, sys.modules['pandas'].DataFrame):
+        return __encode_columns([(name, result[name].to_numpy()) for name in result.columns], len(result))
+    elif isinstance(result, np.ndarray) and __shared.results is not None and result.nbytes >= __shared.min_bytes:
+        __shared.results.append(np.ascontiguousarray(result))
+        return {
+            'class': 'buffer',
+            'index': len(__shared.results) - 1,
+            'dtype': result.dtype.name,
+            'shape': result.shape,
+        }
     elif isinstance(result, np.ndarray):
         return {
             'class': 'ndarray',
@@ -61,6 +106,8 @@ def __encode_result(result):
             'class': 'list',
             'value': [__encode_result(item) for item in result],
         }
+    elif isinstance(result, dict) and __is_columns(result):
+        return __encode_columns(list(result.items()), len(next(iter(result.values()))))
     elif isinstance(result, dict):
         return {
             'class': 'object',
@@ -70,38 +117,329 @@ def __encode_result(result):
         raise RuntimeError(f'Unknown result type: {type(result)}')
 
 
+def __is_columns(result):
+    __lengths = {len(v) if isinstance(v, np.ndarray) and v.ndim == 1 else -1 for v in result.values()}
+    return len(__lengths) == 1 and -1 not in __lengths
+
+
+def __encode_columns(columns, length):
+    columns = [(str(name), np.ascontiguousarray(column)) for name, column in columns]
+    return {
+        'class': 'columns',
+        'length': length,
+        'names': [name for name, _ in columns],
+        'dtypes': [column.dtype.name for _, column in columns],
+        'data': [base64.b64encode(column.tobytes()).decode() for _, column in columns],
+    }
+
+
+__stream = {'iter': None, 'chunk_size': 0, 'credits': 0}
+
+
+def __pump_stream(__stream, __emit):
+    # Sends one chunk per credit; the parent grants a new credit after it takes a chunk off the pipe.
+    while __stream['iter'] is not None and __stream['credits'] > 0:
+        __chunk = list(itertools.islice(__stream['iter'], __stream['chunk_size']))
+        if __chunk:
+            __emit(__encode_result(__chunk))
+            __stream['credits'] -= 1
+        if len(__chunk) < __stream['chunk_size']:
+            __close_stream(__stream, __emit)
+
+
+def __close_stream(__stream, __emit):
+    if __stream['iter'] is None:
+        return
+    __close = getattr(__stream['iter'], 'close', None)
+    __stream['iter'] = None
+    if __close is not None:
+        __close()
+    __emit({'class': 'stop'})
+
+
+__loop = None
+__loop_lock = threading.Lock()
+
+
+def __event_loop():
+    # The loop runs async calls in a background thread, started by the first one. asyncio is imported late like pandas
+    # in __decode_param.
+    import asyncio
+    global __loop
+    with __loop_lock:
+        if __loop is None:
+            __loop = asyncio.new_event_loop()
+            threading.Thread(target=__loop.run_forever, daemon=True).start()
+    return __loop
+
+
+def __async_calls(__write):
+    # Async calls reply 'pending' with an id right away, their result follows as 'done' with the same id.
+    __futures = {}
+    __ids = itertools.count()
+
+    def __finish(__id, __future):
+        __futures.pop(__id, None)
+        try:
+            __reply = {'class': 'done', 'id': __id, 'result': __encode_result(__future.result())}
+        except BaseException:
+            __reply = {'class': 'done', 'id': __id, 'error': traceback.format_exc()}
+        try:
+            __write(__reply)
+        except Exception:
+            pass
+
+    def __submit(__coro):
+        import asyncio
+        __id = next(__ids)
+        __write({'class': 'pending', 'id': __id})
+        __future = asyncio.run_coroutine_threadsafe(__coro, __event_loop())
+        __futures[__id] = __future
+        __future.add_done_callback(lambda __future: __finish(__id, __future))
+
+    def __cancel(__id):
+        __future = __futures.get(__id)
+        if __future is not None:
+            __future.cancel()
+
+    return {'submit': __submit, 'cancel': __cancel}
+
+
+def __handle(__cmd, __args, __emit, __stream, __calls, __scope):
+    # call_cached is a call whose result is kept by the caller, it never passes arrays out of band.
+    if __cmd in ('call', 'call_cached'):
+        __func_name, __params = __args
+        __result = eval(__func_name, __scope)(*__decode_param(__params))
+        if isinstance(__result, types.CoroutineType):
+            __calls['submit'](__result)
+            return
+    elif __cmd == 'set_vars':
+        __param_names, __params = __args
+        __scope.update(dict(zip(__param_names, __decode_param(__params))))
+        __result = None
+    elif __cmd == 'exec':
+        __code, __result_expr = __args
+        exec(__code, __scope)
+        __result = eval(__result_expr, __scope)
+    elif __cmd == 'exec_file':
+        __file_path, = __args
+        with open(__file_path) as __f:
+            exec(__f.read(), __scope)
+        __result = None
+    elif __cmd == 'stream':
+        __func_name, __params, __chunk_size, __credits = __args
+        __close_stream(__stream, __emit)
+        __stream['iter'] = iter(eval(__func_name, __scope)(*__decode_param(__params)))
+        __stream['chunk_size'] = max(1, __chunk_size)
+        __stream['credits'] = __credits
+        __pump_stream(__stream, __emit)
+        return
+    elif __cmd == 'credit':
+        # Credits may arrive after the stream has already finished, they are dropped then.
+        __credits, = __args
+        __stream['credits'] += __credits
+        __pump_stream(__stream, __emit)
+        return
+    elif __cmd == 'close':
+        __close_stream(__stream, __emit)
+        return
+    elif __cmd == 'cancel':
+        # Sent for an async call whose caller gave up, its 'done' reply is dropped by the caller.
+        __id, = __args
+        __calls['cancel'](__id)
+        return
+
+    __emit(__encode_result(__result))
+
+
+# Replies of the embedded interpreter, async calls add theirs from the event loop thread.
+__replies = queue.SimpleQueue()
+
+
+def __put_reply(__reply):
+    __replies.put(json.dumps(__reply))
+
+
+def __next_reply(__timeout):
+    # None is also returned for the None put by __wake_reader.
+    try:
+        return __replies.get(timeout=__timeout)
+    except queue.Empty:
+        return None
+
+
+def __wake_reader():
+    __replies.put(None)
+
+
+__dispatch_calls = __async_calls(__put_reply)
+
+
+def __dispatch(__line, __params):
+    __cmd, *__args = json.loads(__line)
+    __shared.params = __params
+    __shared.results = [] if __cmd in ('call', 'exec') else None
+    try:
+        __handle(__cmd, __args, __put_reply, __stream, __dispatch_calls, globals())
+    except KeyboardInterrupt:
+        __put_reply({'class': 'interrupted'})
+    except Exception:
+        # Fails the command only, the namespace is kept.
+        __put_reply({'class': 'error', 'message': traceback.format_exc()})
+    finally:
+        __results = __shared.results or []
+        __shared.params = []
+        __shared.results = None
+    return __results
+
+
 def __main(__in_pipe, __out_pipe):
     __in_stream = os.fdopen(__in_pipe, 'r')
     __out_stream = os.fdopen(__out_pipe, 'w')
 
+    __busy = [False]
+    __lock = threading.Lock()
+
+    def __interrupt(__signum, __frame):
+        # Only a running command is interrupted, a late SIGINT after its reply is dropped.
+        if __busy[0]:
+            raise KeyboardInterrupt
+
+    def __write(__reply):
+        __line = json.dumps(__reply) + '\n'
+        with __lock:
+            __out_stream.write(__line)
+            __out_stream.flush()
+
+    def __emit(__reply):
+        __busy[0] = False
+        __write(__reply)
+
+    __calls = __async_calls(__write)
+
+    signal.signal(signal.SIGINT, __interrupt)
+
     for __line in __in_stream:
         if __line.strip() == 'EXIT':
             break
 
         __cmd, *__args = json.loads(__line)
-        if __cmd == 'call':
-            __func_name, __params = __args
-            __result = eval(__func_name, globals())(*__decode_param(__params))
-        elif __cmd == 'set_vars':
-            __param_names, __params = __args
-            globals().update(dict(zip(__param_names, __decode_param(__params))))
-            __result = None
-        elif __cmd == 'exec':
-            __code, __result_expr = __args
-            exec(__code, globals())
-            __result = eval(__result_expr, globals())
-        elif __cmd == 'exec_file':
-            __file_path, = __args
-            with open(__file_path) as __f:
-                exec(__f.read(), globals())
-            __result = None
-
-        __msg = json.dumps(__encode_result(__result))
-        __out_stream.write(__msg + '\n')
-        __out_stream.flush()
+        __busy[0] = True
+        try:
+            __handle(__cmd, __args, __emit, __stream, __calls, globals())
+        except KeyboardInterrupt:
+            __emit({'class': 'interrupted'})
+        __busy[0] = False
 
     os.close(__in_pipe)
     os.close(__out_pipe)
 
 
+
+def __from_memfd(__fd):
+    try:
+        return mmap.mmap(__fd, 0, prot=mmap.PROT_READ)
+    finally:
+        os.close(__fd)
+
+
+def __to_memfd(__array):
+    __fd = os.memfd_create('pyhandler')
+    with open(__fd, 'wb', closefd=False) as __f:
+        __f.write(__array.data)
+    return __fd
+
+
+class __Disconnected(Exception):
+    pass
+
+
+class __Namespace(dict):
+    # Globals of one client. Names it does not define are looked up in the module globals, which hold what the server
+    # preloaded for everyone.
+    def __missing__(self, __name):
+        return globals()[__name]
+
+
+def __serve_client(__conn):
+    # Arrays of at least min_bytes travel as memfds passed along with the line that references them.
+    __stream = {'iter': None, 'chunk_size': 0, 'credits': 0}
+    __shared.min_bytes = 1 << 16
+    __buffer = bytearray()
+    __fds = []
+    __lock = threading.Lock()
+
+    def __emit(__reply):
+        # Also called from the event loop thread for async calls, which never has arrays to pass.
+        __out_fds = [__to_memfd(__array) for __array in __shared.results or []]
+        if __shared.results:
+            __shared.results = []
+        __data = (json.dumps(__reply) + '\n').encode()
+        try:
+            with __lock:
+                __sent = socket.send_fds(__conn, [__data], __out_fds) if __out_fds else 0
+                __conn.sendall(__data[__sent:])
+        except OSError as __e:
+            raise __Disconnected() from __e
+        finally:
+            for __fd in __out_fds:
+                os.close(__fd)
+
+    __calls = __async_calls(__emit)
+    __scope = __Namespace()
+
+    def __recv():
+        try:
+            return socket.recv_fds(__conn, 1 << 16, 253)
+        except OSError as __e:
+            raise __Disconnected() from __e
+
+    with __conn:
+        try:
+            while True:
+                __data, __new_fds, _, _ = __recv()
+                if not __data:
+                    break
+                __start = len(__buffer)
+                __buffer += __data
+                __fds += __new_fds
+                __end = __buffer.find(b'\n', __start)
+                while __end >= 0:
+                    __cmd, *__args = json.loads(__buffer[:__end])
+                    del __buffer[:__end + 1]
+                    __shared.params = [__from_memfd(__fd) for __fd in __fds]
+                    __shared.results = [] if __cmd in ('call', 'exec') else None
+                    __fds = []
+                    try:
+                        __handle(__cmd, __args, __emit, __stream, __calls, __scope)
+                    except __Disconnected:
+                        raise
+                    except Exception:
+                        __emit({'class': 'error', 'message': traceback.format_exc()})
+                    finally:
+                        __shared.params = []
+                        __shared.results = None
+                    __end = __buffer.find(b'\n')
+        except __Disconnected:
+            pass
+
+
+def __serve(__path, __files):
+    for __file_path in __files:
+        with open(__file_path) as __f:
+            exec(__f.read(), globals())
+    if os.path.exists(__path):
+        os.unlink(__path)
+    __server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    __server.bind(__path)
+    __server.listen()
+    while True:
+        __conn, _ = __server.accept()
+        threading.Thread(target=__serve_client, args=(__conn,), daemon=True).start()
+
+
+if __name__ == '__main__' and sys.argv[1:2] == ['--serve']:
+    __serve(sys.argv[2], sys.argv[3:])
+
+
 # END )PYHANDLER";